@@ -1,38 +1,176 @@
+#include <arpa/inet.h>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+
 #include "proxy/proxy_server.h"
 
+// Parses "--name=value" options of command line. Returns false if argument isn't option with such name
+bool parse_option(std::string const &arg, std::string const &name, std::string &value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+// Parses whole <str> as decimal number, <tag> names what is parsed in error
+long parse_number(std::string const &tag, std::string const &str) {
+    size_t end = 0;
+    long value = 0;
+    try {
+        value = std::stol(str, &end);
+    } catch (std::logic_error const &) {
+        // invalid_argument if there's no number, out_of_range if it doesn't fit
+        end = 0;
+    }
+    if (end == 0 || end != str.length()) {
+        throw annotated_exception(tag, "expected number, got " + str);
+    }
+    return value;
+}
+
+uint16_t parse_port(std::string const &tag, std::string const &str) {
+    long value = parse_number(tag, str);
+    if (value < 0 || value > UINT16_MAX) {
+        throw annotated_exception(tag, "expected port from 0 to 65535, got " + str);
+    }
+    return (uint16_t) value;
+}
+
+bool parse_option(std::string const &arg, std::string const &name, long &value) {
+    std::string str;
+    if (!parse_option(arg, name, str)) {
+        return false;
+    }
+    value = parse_number(name, str);
+    return true;
+}
+
+bool parse_option(std::string const &arg, std::string const &name, uint16_t &port) {
+    std::string str;
+    if (!parse_option(arg, name, str)) {
+        return false;
+    }
+    port = parse_port(name, str);
+    return true;
+}
+
+// Parses "IP:PORT" of cluster member
+endpoint parse_endpoint(std::string const &str) {
+    size_t colon = str.find(':');
+    in_addr ip;
+    if (colon == std::string::npos || inet_pton(AF_INET, str.substr(0, colon).c_str(), &ip) != 1) {
+        throw annotated_exception("endpoint", "expected IP:PORT, got " + str);
+    }
+    return {ip.s_addr, htons(parse_port("endpoint", str.substr(colon + 1)))};
+}
+
+// Parses "IP:HTTP_PORT:QUERY_PORT" of peer
+proxy_server::settings::peer parse_peer(std::string const &str) {
+    size_t last = str.rfind(':');
+    if (last == std::string::npos) {
+        throw annotated_exception("peer", "expected IP:HTTP_PORT:QUERY_PORT, got " + str);
+    }
+    endpoint http = parse_endpoint(str.substr(0, last));
+    return {http, {http.ip, htons(parse_port("peer", str.substr(last + 1)))}};
+}
+
+// Parses "IP:PORT[:WEIGHT]" of parent proxy
+proxy_server::settings::parent parse_parent(std::string const &str) {
+    size_t first = str.find(':');
+    size_t last = str.rfind(':');
+    if (first == last) {
+        return {parse_endpoint(str), 1};
+    }
+    long weight = parse_number("parent", str.substr(last + 1));
+    if (weight <= 0 || weight > UINT_MAX) {
+        throw annotated_exception("parent", "expected positive WEIGHT, got " + str);
+    }
+    return {parse_endpoint(str.substr(0, last)), (unsigned) weight};
+}
+
 int main(int argc, char** args) {
     try {
-        uint16_t port = 8080;
-        if (argc > 1) {
-            port = (uint16_t) std::stoi(args[1]);
+        proxy_server::settings config;
+        long events_size = 200;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = args[i];
+            long value;
+            std::string str;
+            if (parse_option(arg, "backlog", value)) {
+                config.queue_size = (int) value;
+            } else if (parse_option(arg, "events", value)) {
+                events_size = value;
+            } else if (parse_option(arg, "accept-budget", value)) {
+                config.accept_budget = (size_t) value;
+            } else if (parse_option(arg, "cache-dir", str)) {
+                config.cache_directory = str;
+            } else if (parse_option(arg, "cache-size", value)) {
+                config.disk_cache_size = (size_t) value * 1024 * 1024;
+            } else if (parse_option(arg, "snapshot", str)) {
+                config.snapshot_file = str;
+            } else if (parse_option(arg, "sort-query", value)) {
+                config.sort_query = value != 0;
+            } else if (parse_option(arg, "stale-while-revalidate", value)) {
+                config.stale_while_revalidate = value;
+            } else if (parse_option(arg, "stale-if-error", value)) {
+                config.stale_if_error = value;
+            } else if (parse_option(arg, "compress", value)) {
+                config.compression = value != 0;
+            } else if (parse_option(arg, "splice-threshold", value)) {
+                config.splice_threshold = (size_t) value;
+            } else if (parse_option(arg, "zerocopy-threshold", value)) {
+                config.zerocopy_threshold = (size_t) value;
+            } else if (parse_option(arg, "peer-port", config.peer_port)) {
+            } else if (parse_option(arg, "peer", str)) {
+                config.peers.push_back(parse_peer(str));
+            } else if (parse_option(arg, "peer-timeout", value)) {
+                config.peer_timeout = value;
+            } else if (parse_option(arg, "member", str)) {
+                config.members.push_back(parse_endpoint(str));
+            } else if (parse_option(arg, "self", str)) {
+                config.self = parse_endpoint(str);
+            } else if (parse_option(arg, "parent", str)) {
+                config.parents.push_back(parse_parent(str));
+            } else if (parse_option(arg, "parent-check", value)) {
+                config.parent_check = value;
+            } else {
+                config.port = parse_port("port", arg);
+            }
         }
 
-        epoll_wrap epoll(200);
+        // Signals are blocked before any thread is started, so threads inherit the mask
+        signal_fd sig_fd({SIGINT, SIGTERM, SIGPIPE}, {signal_fd::SIMPLE});
+
+        epoll_wrap epoll((int) events_size);
         resolver<proxy_server::resolver_extra> ip_resolver;
-        proxy_server proxy(epoll, ip_resolver, port, 200);
+        proxy_server proxy(epoll, ip_resolver, config);
 
-        std::string tag = "server on port " + std::to_string(port);
-        signal_fd sig_fd({SIGINT, SIGPIPE}, {signal_fd::SIMPLE});
+        std::string tag = "server on port " + std::to_string(config.port);
 
         epoll_registration signal_registration(epoll, std::move(sig_fd), fd_state::IN);
-        signal_registration.update([&signal_registration, &epoll, tag](fd_state state) mutable {
+        signal_registration.update([&signal_registration, &epoll, &proxy, tag](fd_state state) mutable {
             if (state.is(fd_state::IN)) {
                 struct signalfd_siginfo sinf;
                 long size = signal_registration.get_fd().read(&sinf, sizeof(struct signalfd_siginfo));
                 if (size != sizeof(struct signalfd_siginfo)) {
                     return;
                 }
-                if (sinf.ssi_signo == SIGINT) {
+                if (sinf.ssi_signo == SIGINT || sinf.ssi_signo == SIGTERM) {
                     log("\n" + tag, "stopped");
+                    proxy.save_snapshot();
                     epoll.stop_wait();
                 }
             }
         });
 
-        log(tag, "started");
+        log(tag, std::string("started, header scanning uses ") + get_scan_kernels_name());
         epoll.start_wait();
 
     } catch (annotated_exception const &e) {
         log(e);
+        return 1;
     }
 }
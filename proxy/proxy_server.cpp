@@ -1,29 +1,66 @@
 #include "proxy_server.h"
 
+proxy_server::settings::settings() : settings(8080, -1) { }
+
+proxy_server::settings::settings(uint16_t port, int queue_size) : port(port), queue_size(queue_size),
+                                                                  accept_budget(64), cache_directory(""),
+                                                                  disk_cache_size((size_t) 1024 * 1024 * 1024),
+                                                                  snapshot_file(""),
+                                                                  sort_query(false), stale_while_revalidate(0),
+                                                                  stale_if_error(0), compression(true),
+                                                                  splice_threshold(64 * 1024),
+                                                                  zerocopy_threshold(0), peer_port(0), peers(),
+                                                                  peer_timeout(50), members(), self({0, 0}),
+                                                                  parents(), parent_check(10) { }
+
+std::string const proxy_server::CLUSTER_VIA = "1.1 proxy_server-cluster";
+
 proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, uint16_t port, int queue_size) :
-        epoll(s_epoll), rt(rt), ticks(0) {
+        proxy_server(s_epoll, rt, settings(port, queue_size)) {
+}
 
-    socket_wrap listener(socket_wrap::NONBLOCK);
+proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, settings const &config) :
+        epoll(s_epoll), rt(rt), ticks(0), disk(config.cache_directory, config.disk_cache_size),
+        keys(config.sort_query), popularity(MAX_CACHE_SIZE), compressed_responses(0), compressed_input(0),
+        compressed_output(0), compression_seconds(0), config(config), next_query_id(0),
+        self_member(config.members.size()), next_parent_check(std::chrono::steady_clock::now()) {
+
+    socket_wrap listener({socket_wrap::NONBLOCK, socket_wrap::CLOEXEC});
     event_fd notifier(0, event_fd::SEMAPHORE);
     timer_fd timer(timer_fd::MONOTONIC, timer_fd::SIMPLE);
 
-    listener.bind(port);
-    listener.listen(queue_size);
+    listener.bind(config.port);
+    listener.listen(config.queue_size);
     timer.set_interval(TICK_INTERVAL, TICK_INTERVAL);
 
     epoll_wrap::handler_t listener_handler = [this](fd_state state) {
         if (state.is(fd_state::IN)) {
             socket_wrap &listener = *static_cast<socket_wrap *>(&this->listener->second.get_fd());
-            try {
-                socket_wrap client = listener.accept(socket_wrap::NONBLOCK);
+            // Drain pending connections, but don't starve other sockets
+            for (size_t accepted = 0; accepted < this->config.accept_budget; accepted++) {
+                io_result result;
+                socket_wrap client = listener.try_accept({socket_wrap::NONBLOCK, socket_wrap::CLOEXEC}, result);
+                if (!result.is_ok()) {
+                    int err = result.get_errno();
+                    if (err == EAGAIN || err == EWOULDBLOCK) {
+                        // Queue is empty
+                        return;
+                    }
+                    if (err == ECONNABORTED || err == EINTR) {
+                        continue;
+                    }
+                    log("accept failed", result.get_exception("accept").what());
+                    return;
+                }
 
                 log("new client accepted", client.get());
-                sockets_t::iterator it = save_registration(epoll_registration(epoll, std::move(client), fd_state::IN),
-                                                           SHORT_SOCKET_TIMEOUT);
-                read(it->second, client_request(), it, first_request_read(it));
-            } catch (annotated_exception const& e) {
-                log("accept failed", e.what());
-                return;
+                // Descriptor may be reused, sends to its previous socket can't be tracked anymore
+                release_zerocopy(client.get());
+                sockets_t::iterator it = save_registration(
+                        epoll_registration(epoll, std::move(client), fd_state::IN), SHORT_SOCKET_TIMEOUT,
+                        std::make_shared<arena>((size_t) ARENA_BLOCK_SIZE));
+                read(it->second, make_shared_in<client_request>(it->second.memory, it->second.memory), it,
+                     first_request_read(it));
             }
         }
     };
@@ -32,64 +69,11 @@ proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, uint16_t port, i
         if (state.is(fd_state::IN)) {
             uint64_t u;
             file_descriptor &notifier = this->notifier->second.get_fd();
-            notifier.read(&u, sizeof(uint64_t));
-
-            socket_wrap destination(socket_wrap::NONBLOCK);
-
-            resolved_ip_t ip = this->rt.get_ip();
-
-            on_resolve_t::iterator it = on_resolve.find({ip.get_extra().socket, ip.get_extra().host});
-            sockets_t::iterator client = sockets.find(ip.get_extra().socket);
-            if (it == on_resolve.end()) {
-                // Client disconnected during resolving of ip
-                log(client, "client disconnected during resolving of ip");
-                return;
-            }
-
-            if (!ip.has_ip()) {
-                log(client,
-                    "address " + ip.get_extra().host + " not found");
-                on_resolve.erase(it);
-                send_404(client);
+            if (!notifier.try_read(&u, sizeof(uint64_t)).is_ok()) {
                 return;
             }
 
-            try {
-                destination.connect(ip.get_ip());
-            } catch (annotated_exception const &e) {
-                if (e.get_errno() != EINPROGRESS) {
-                    log(e);
-                    send_404(client);
-                    on_resolve.erase(it);
-                    return;
-                }
-            }
-
-            connection conn(std::move(client->second),
-                            epoll_registration(epoll, std::move(destination), fd_state::OUT),
-                            SHORT_SOCKET_TIMEOUT, ticks);
-
-            sockets.erase(client);
-            log(conn, "ip for " + ip.get_extra().host + " resolved: " + to_string(ip.get_ip()));
-
-            connections_t::iterator conn_it = save_connection(std::move(conn));
-
-            resolver_extra ip_extra = ip.get_extra();
-            conn_it->get_client_registration()
-                    .update(fd_state::RDHUP,
-                            [this, ip_extra, conn_it](fd_state state) {
-                                // If client disconnect while we haven't connected to server
-                                if (state.is(fd_state::RDHUP)) {
-                                    log(conn_it, "client dropped connection");
-                                    auto it = on_resolve.find({ip_extra.socket, ip_extra.host});
-                                    if (it != on_resolve.end()) {
-                                        on_resolve.erase(it);
-                                    }
-                                    close(conn_it);
-                                }
-                            });
-
-            conn_it->get_server_registration().update(make_server_connect_handler(conn_it, ip));
+            connect_to_ip(this->rt.get_ip());
         }
     };
 
@@ -97,12 +81,18 @@ proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, uint16_t port, i
         if (state.is(fd_state::IN)) {
             file_descriptor &timer = this->timer->second.get_fd();
             uint64_t ticked = 0;
-            timer.read(&ticked, sizeof ticked);
+            if (!timer.try_read(&ticked, sizeof ticked).is_ok()) {
+                return;
+            }
 
             ticks += ticked * TICK_INTERVAL;
+            while (!zerocopy_orphans.empty() && zerocopy_orphans.front().first <= ticks) {
+                zerocopy_orphans.pop_front();
+            }
             for (auto it = sockets.begin(); it != sockets.end();) {
                 if (it->second.expires_in <= ticks) {
                     log(it, "closed due timeout");
+                    release_zerocopy(it->second.get_fd().get());
                     it = sockets.erase(it);
                 } else {
                     it++;
@@ -113,11 +103,19 @@ proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, uint16_t port, i
             for (auto it = connections.begin(); it != connections.end();) {
                 if (it->expires_in <= ticks) {
                     log(it, "closed due timeout");
+                    release_zerocopy(it->get_client().get());
                     it = connections.erase(it);
                 } else {
                     it++;
                 }
             }
+
+            if (!parents.empty() && this->config.parent_check != 0 &&
+                std::chrono::steady_clock::now() >= next_parent_check) {
+                check_parents();
+                next_parent_check = std::chrono::steady_clock::now() +
+                                    std::chrono::seconds(this->config.parent_check);
+            }
         }
     };
 
@@ -127,21 +125,188 @@ proxy_server::proxy_server(epoll_wrap &s_epoll, resolver_t &rt, uint16_t port, i
                                        INFINITE_TIMEOUT);
     this->timer = save_registration(epoll_registration(epoll, std::move(timer), fd_state::IN, timer_handler),
                                     INFINITE_TIMEOUT);
+
+    if (!config.members.empty()) {
+        std::vector<std::string> names;
+        for (size_t i = 0; i < config.members.size(); i++) {
+            endpoint const &member = config.members[i];
+            names.push_back(to_string(member));
+            bool is_self = config.self.port != 0 ? member.ip == config.self.ip && member.port == config.self.port
+                                                 : member.port == htons(config.port);
+            if (is_self) {
+                if (self_member != config.members.size() && config.self.port == 0) {
+                    // Port is the same on several hosts, it doesn't tell which member is this proxy
+                    throw annotated_exception("cluster", "several members have port " + std::to_string(config.port) +
+                                                         ", set --self");
+                }
+                self_member = i;
+            }
+        }
+        cluster = hash_ring(names);
+    }
+
+    if (!config.parents.empty()) {
+        std::vector<unsigned> weights;
+        for (settings::parent const &parent : config.parents) {
+            weights.push_back(parent.weight);
+        }
+        parents = upstream_pool(weights);
+    }
+
+    if (config.peer_port != 0 || !config.peers.empty()) {
+        datagram_socket peer_socket({datagram_socket::NONBLOCK, datagram_socket::CLOEXEC});
+        timer_fd peer_timer(timer_fd::MONOTONIC, timer_fd::NONBLOCK);
+        if (config.peer_port != 0) {
+            peer_socket.bind(config.peer_port);
+        }
+
+        epoll_wrap::handler_t peer_handler = [this](fd_state state) {
+            if (state.is(fd_state::IN)) {
+                datagram_socket &peer_socket = *static_cast<datagram_socket *>(&this->peer_socket->second.get_fd());
+                char buffer[peer_message::MAX_LENGTH];
+                for (size_t handled = 0; handled < PEER_BUDGET; handled++) {
+                    endpoint from;
+                    io_result received = peer_socket.try_receive_from(buffer, sizeof buffer, from);
+                    if (!received.is_ok()) {
+                        return;
+                    }
+                    try {
+                        handle_peer_message(peer_message(buffer, (size_t) received.get()), from);
+                    } catch (annotated_exception const &e) {
+                        log("peer " + to_string(from), e.what());
+                    }
+                }
+            }
+        };
+
+        epoll_wrap::handler_t peer_timer_handler = [this](fd_state state) {
+            if (state.is(fd_state::IN)) {
+                uint64_t expired;
+                if (!this->peer_timer->second.get_fd().try_read(&expired, sizeof expired).is_ok()) {
+                    return;
+                }
+
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for (auto it = peer_queries.begin(); it != peer_queries.end();) {
+                    auto next = std::next(it);
+                    if (it->second.deadline <= now) {
+                        log(it->second.client, "peers didn't answer in time");
+                        finish_query(it, nullptr);
+                    }
+                    it = next;
+                }
+                arm_peer_timer();
+            }
+        };
+
+        this->peer_socket = save_registration(
+                epoll_registration(epoll, std::move(peer_socket), fd_state::IN, peer_handler), INFINITE_TIMEOUT);
+        this->peer_timer = save_registration(
+                epoll_registration(epoll, std::move(peer_timer), fd_state::IN, peer_timer_handler), INFINITE_TIMEOUT);
+    }
+
+    if (!config.snapshot_file.empty() && access(config.snapshot_file.c_str(), R_OK) == 0) {
+        start_snapshot_loading();
+    }
+}
+
+void proxy_server::start_snapshot_loading() {
+    event_fd notifier(0, event_fd::SIMPLE);
+
+    epoll_wrap::handler_t loader_handler = [this](fd_state state) {
+        if (state.is(fd_state::IN)) {
+            uint64_t u;
+            if (!this->loader_notifier->second.get_fd().try_read(&u, sizeof(uint64_t)).is_ok()) {
+                return;
+            }
+
+            // Check before taking entries, so nothing loaded after the check is lost
+            bool finished = loader->is_finished();
+            snapshot_loader::entries_t entries = loader->get_loaded();
+            for (auto it = entries.begin(); it != entries.end(); it++) {
+                // Responses received during loading are fresher than saved ones
+                if (cache.size() < MAX_CACHE_SIZE && !cache.has(it->first)) {
+                    try {
+                        cache.insert(std::move(it->first), make_entry(std::move(it->second)));
+                    } catch (std::exception const &) {
+                        log("snapshot", "broken response " + it->first + " skipped");
+                    }
+                }
+            }
+
+            if (finished) {
+                long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - loading_start).count();
+                log("snapshot", "cache is warm: " + std::to_string(cache.size()) + " responses, " +
+                                std::to_string(elapsed) + " ms");
+                loader.reset();
+                close(loader_notifier);
+            }
+        }
+    };
+
+    loading_start = std::chrono::steady_clock::now();
+    loader_notifier = save_registration(epoll_registration(epoll, std::move(notifier), fd_state::IN, loader_handler),
+                                        INFINITE_TIMEOUT);
+    loader.reset(new snapshot_loader(config.snapshot_file, loader_notifier->second.get_fd()));
+}
+
+void proxy_server::save_snapshot() const {
+    if (config.snapshot_file.empty()) {
+        return;
+    }
+    if (loader) {
+        // Memory cache doesn't have the rest of the file yet, saving it would lose them
+        log("snapshot", "loading isn't finished, " + config.snapshot_file + " is kept as is");
+        return;
+    }
+    try {
+        snapshot_writer writer(config.snapshot_file);
+        cache.for_each([&writer](std::string const &key, entry_ptr const &entry) {
+            writer.write(key, entry->message);
+        });
+        writer.commit();
+        log("snapshot", std::to_string(cache.size()) + " responses saved to " + config.snapshot_file);
+    } catch (annotated_exception const &e) {
+        log(e);
+    }
 }
 
 
 proxy_server::action_with_request proxy_server::first_request_read(sockets_t::iterator client) {
-    return [this, client](client_request rqst) {
-        std::string host = rqst.get_header().get_property("host");
-        connect_to_server(client, host, handle_client_request(rqst));
+    return [this, client](request_ptr rqst) {
+        start_request(client, std::move(rqst));
     };
 }
 
 
-void proxy_server::connect_to_server(sockets_t::iterator sock, std::string host, action_with_connection do_next) {
-    socket_wrap &s = *static_cast<socket_wrap *>(&sock->second.get_fd());
+void proxy_server::connect_to_server(sockets_t::iterator sock, request_ptr rqst, action_with_connection do_next) {
+    if (!parents.empty()) {
+        connect_to_parent(sock, std::move(rqst), std::move(do_next), parents.size());
+        return;
+    }
+
+    int s = sock->second.get_fd().get();
+    std::string host = rqst->get_header().get_property(header_name::HOST);
     log(sock, "establishing connection to " + host);
-    on_resolve.insert({{s.get(), host}, do_next});
+    wait_for_server(sock, std::move(rqst), std::move(do_next), nullptr);
+    rt.resolve_host(host, notifier->second.get_fd(), {s, host});
+}
+
+void proxy_server::connect_to_endpoint(sockets_t::iterator sock, request_ptr rqst, endpoint address,
+                                       action_with_connection do_next, action_with<sockets_t::iterator> on_fail) {
+    int s = sock->second.get_fd().get();
+    std::string host = rqst->get_header().get_property(header_name::HOST);
+    log(sock, "establishing connection to " + to_string(address) + " for " + host);
+    wait_for_server(sock, std::move(rqst), std::move(do_next), std::move(on_fail));
+    connect_to_ip(resolved_ip_t({address.ip}, address.port, {s, host}));
+}
+
+void proxy_server::wait_for_server(sockets_t::iterator sock, request_ptr rqst, action_with_connection do_next,
+                                   action_with<sockets_t::iterator> on_fail) {
+    int s = sock->second.get_fd().get();
+    std::string host = rqst->get_header().get_property(header_name::HOST);
+    on_resolve.insert({{s, host}, {std::move(rqst), std::move(do_next), std::move(on_fail)}});
 
     // If socket disconnected during resolving, stop resolving
     sock->second.update(fd_state::RDHUP, [this, sock, host](fd_state state) {
@@ -151,27 +316,473 @@ void proxy_server::connect_to_server(sockets_t::iterator sock, std::string host,
             close(sock);
         }
     });
+}
+
+void proxy_server::fail_connecting(on_resolve_t::iterator pending, sockets_t::iterator client) {
+    pending_request failed = std::move(pending->second);
+    on_resolve.erase(pending);
+    if (failed.on_fail) {
+        failed.on_fail(client);
+    } else {
+        send_stale_or_404(client, failed.rqst);
+    }
+}
+
+void proxy_server::start_request(sockets_t::iterator client, request_ptr rqst) {
+    if (send_from_cache(client, rqst)) {
+        return;
+    }
+    size_t member;
+    if (should_forward(*rqst, member)) {
+        forward_to_member(client, std::move(rqst), member);
+        return;
+    }
+    if (should_ask_peers(*rqst)) {
+        ask_peers(client, std::move(rqst));
+        return;
+    }
+    connect_to_server(client, rqst, handle_client_request(rqst));
+}
+
+bool proxy_server::should_ask_peers(client_request const &rqst) const {
+    request_header const &header = rqst.get_header();
+    if (config.peers.empty() || header.get_request_line().get_type() != request_line::GET || !rqst.is_read() ||
+        is_only_if_cached(header)) {
+        return false;
+    }
+    // Stale cached response is validated with origin server
+    std::string url = to_url(header);
+    return !cache.has(url) && !disk.has(url);
+}
+
+bool proxy_server::is_only_if_cached(request_header const &request) {
+    return to_lower(request.get_property(header_name::CACHE_CONTROL)).find("only-if-cached") != std::string::npos;
+}
+
+void proxy_server::ask_peers(sockets_t::iterator client, request_ptr rqst) {
+    datagram_socket const &peer_socket = *static_cast<datagram_socket const *>(&this->peer_socket->second.get_fd());
+    uint32_t id = next_query_id++;
+    std::string key = to_url(rqst->get_header());
+    std::string query = to_string(peer_message(peer_message::QUERY, id, key));
+
+    size_t asked = 0;
+    for (settings::peer const &peer : config.peers) {
+        io_result sent = peer_socket.try_send_to(query.data(), query.length(), peer.query);
+        if (sent.is_ok()) {
+            asked++;
+        } else {
+            log("peer " + to_string(peer.query), sent.get_exception("sendto").what());
+        }
+    }
+    if (asked == 0) {
+        connect_to_server(client, rqst, handle_client_request(rqst));
+        return;
+    }
+
+    log(client, "asking " + std::to_string(asked) + " peers about " + key);
+    std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(config.peer_timeout);
+    peer_queries.insert({id, {client, std::move(rqst), std::move(key), asked, deadline}});
+
+    // If client disconnects during query, forget it
+    client->second.update(fd_state::RDHUP, [this, client, id](fd_state state) {
+        if (state.is(fd_state::RDHUP)) {
+            log(client, "disconnected during query of peers");
+            peer_queries.erase(id);
+            close(client);
+        }
+    });
+    arm_peer_timer();
+}
+
+void proxy_server::handle_peer_message(peer_message const &message, endpoint const &from) {
+    datagram_socket const &peer_socket = *static_cast<datagram_socket const *>(&this->peer_socket->second.get_fd());
+    std::string const &key = message.get_key();
+
+    if (message.get_opcode() == peer_message::QUERY) {
+        // Only configured peers learn what is cached
+        bool known = false;
+        for (settings::peer const &peer : config.peers) {
+            known |= peer.query.ip == from.ip;
+        }
+        if (!known) {
+            log("peer " + to_string(from), "query from unknown peer ignored");
+            return;
+        }
+
+        bool hit = cache.has(key) ? get_freshness(*cache.find(key)).is_fresh() : disk.has(key);
+        std::string answer = to_string(message.answer(hit));
+        io_result sent = peer_socket.try_send_to(answer.data(), answer.length(), from);
+        if (!sent.is_ok()) {
+            log("peer " + to_string(from), sent.get_exception("sendto").what());
+        }
+        return;
+    }
+
+    // Late answers and answers of strangers are ignored
+    peer_queries_t::iterator query = peer_queries.find(message.get_id());
+    if (query == peer_queries.end() || query->second.key != key) {
+        return;
+    }
+    settings::peer const *sender = nullptr;
+    for (settings::peer const &peer : config.peers) {
+        if (peer.query.ip == from.ip && peer.query.port == from.port) {
+            sender = &peer;
+        }
+    }
+    if (sender == nullptr) {
+        return;
+    }
+
+    if (message.get_opcode() == peer_message::HIT) {
+        finish_query(query, sender);
+    } else if (--query->second.answers_left == 0) {
+        log(query->second.client, "no peer has " + key);
+        finish_query(query, nullptr);
+    }
+}
+
+void proxy_server::finish_query(peer_queries_t::iterator query, settings::peer const *peer) {
+    sockets_t::iterator client = query->second.client;
+    request_ptr rqst = std::move(query->second.rqst);
+    peer_queries.erase(query);
+    arm_peer_timer();
+
+    if (peer == nullptr) {
+        connect_to_server(client, rqst, handle_client_request(rqst));
+        return;
+    }
+    std::string name = to_string(peer->http);
+    log(client, "peer " + name + " has response");
+    connect_to_endpoint(client, rqst, peer->http, fetch_from_peer(rqst, name),
+                        [this, rqst](sockets_t::iterator client) {
+                            log(client, "peer is unreachable, asking origin server");
+                            connect_to_server(client, rqst, handle_client_request(rqst));
+                        });
+}
+
+void proxy_server::arm_peer_timer() {
+    timer_fd &peer_timer = *static_cast<timer_fd *>(&this->peer_timer->second.get_fd());
+    if (peer_queries.empty()) {
+        peer_timer.set_timeout_ms(0);
+        return;
+    }
+
+    std::chrono::steady_clock::time_point nearest = peer_queries.begin()->second.deadline;
+    for (auto it = peer_queries.begin(); it != peer_queries.end(); it++) {
+        nearest = std::min(nearest, it->second.deadline);
+    }
+    long left = (long) std::chrono::duration_cast<std::chrono::milliseconds>(
+            nearest - std::chrono::steady_clock::now()).count();
+    // 0 would disarm timer
+    peer_timer.set_timeout_ms(std::max(left, 1L));
+}
+
+proxy_server::action_with_connection proxy_server::fetch_from_peer(request_ptr rqst, std::string peer) {
+    return [this, rqst, peer](connections_t::iterator conn) {
+        conn->upstream = peer;
+
+        // Whole response is asked, conditions and ranges of client are applied to it here
+        request_header header = rqst->get_header();
+        header.erase_property(header_name::IF_NONE_MATCH);
+        header.erase_property(header_name::IF_MODIFIED_SINCE);
+        header.erase_property(header_name::RANGE);
+        header.erase_property(header_name::IF_RANGE);
+        std::string cache_control = header.get_property(header_name::CACHE_CONTROL);
+        header.set_property(header_name::CACHE_CONTROL,
+                            cache_control.empty() ? "only-if-cached" : cache_control + ", only-if-cached");
+
+        send_and_read(conn->get_server_registration(), std::make_shared<client_request>(header, ""), conn,
+                      [this, conn, rqst](response_ptr resp) {
+                          response_header const &header = resp->get_header();
+                          if (header.get_request_line().get_code() != 200 || !should_cache(header)) {
+                              log(conn, "peer doesn't have response anymore");
+                              fetch_from_origin(conn, rqst);
+                              return;
+                          }
+
+                          log(conn, "response fetched from peer");
+                          entry_ptr entry = make_entry(resp->get_cache(), header);
+                          save_cached(add_variant(rqst->get_header(), header), entry);
+                          send_fresh(conn, rqst, entry);
+                      },
+                      [this, conn, rqst]() {
+                          log(conn, "peer failed");
+                          fetch_from_origin(conn, rqst);
+                      });
+    };
+}
+
+bool proxy_server::should_forward(client_request const &rqst, size_t &member) const {
+    request_header const &header = rqst.get_header();
+    if (cluster.empty() || header.get_request_line().get_type() != request_line::GET || !rqst.is_read() ||
+        is_only_if_cached(header) ||
+        header.get_property(header_name::VIA).find(CLUSTER_VIA) != std::string::npos) {
+        return false;
+    }
+    // Response that is still cached here (E.G. from time before cluster was changed) is used
+    std::string url = to_url(header);
+    if (cache.has(url) || disk.has(url)) {
+        return false;
+    }
+    member = cluster.get_member(url);
+    return member != self_member;
+}
+
+void proxy_server::forward_to_member(sockets_t::iterator client, request_ptr rqst, size_t member) {
+    endpoint address = config.members[member];
+    std::string name = to_string(address);
+    log(client, "forwarding " + to_url(rqst->get_header()) + " to member " + name);
+
+    std::shared_ptr<load_lease> load = std::make_shared<load_lease>(cluster.acquire(member));
+    connect_to_endpoint(client, rqst, address,
+                        [this, rqst, name, load](connections_t::iterator conn) {
+                            conn->upstream = name;
+                            conn->load = std::move(*load);
+
+                            // Request keeps pipelined requests that follow it, so its header is replaced
+                            request_header header = rqst->get_header();
+                            std::string via = header.get_property(header_name::VIA);
+                            header.set_property(header_name::VIA, via.empty() ? CLUSTER_VIA : via + ", " + CLUSTER_VIA);
+                            rqst->set_header(header);
+                            fast_transfer(conn, rqst);
+                        },
+                        [this, rqst](sockets_t::iterator client) {
+                            log(client, "member is unreachable, asking origin server");
+                            connect_to_server(client, rqst, handle_client_request(rqst));
+                        });
+}
+
+void proxy_server::connect_to_parent(sockets_t::iterator sock, request_ptr rqst, action_with_connection do_next,
+                                     size_t attempts) {
+    size_t parent = parents.pick();
+    std::shared_ptr<load_lease> load = std::make_shared<load_lease>(parents.acquire(parent));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    connect_to_endpoint(sock, rqst, config.parents[parent].address,
+                        [this, parent, load, start, do_next](connections_t::iterator conn) {
+                            parents.report_success(parent, elapsed_ms(start));
+                            conn->parent = parent;
+                            conn->load = std::move(*load);
+                            do_next(conn);
+                        },
+                        [this, parent, rqst, do_next, attempts](sockets_t::iterator client) {
+                            parents.report_failure(parent);
+                            if (attempts > 1) {
+                                log(client, "parent failed, trying another one");
+                                connect_to_parent(client, rqst, do_next, attempts - 1);
+                            } else {
+                                send_stale_or_404(client, rqst);
+                            }
+                        });
+}
+
+void proxy_server::prepare_parent_request(connections_t::iterator conn, request_ptr rqst) {
+    if (conn->parent == upstream_pool::NONE) {
+        return;
+    }
+    conn->load = parents.acquire(conn->parent);
+    conn->sent = std::chrono::steady_clock::now();
+
+    // Parent needs absolute URL to know server. Parsed header keeps relative one, cache keys are made of it.
+    // CONNECT already names server by its host:port
+    request_header const &header = rqst->get_header();
+    if (header.get_request_line().get_type() != request_line::CONNECT &&
+        header.get_request_line().get_url().compare(0, 1, "/") == 0) {
+        request_header absolute = header;
+        request_line line = absolute.get_request_line();
+        line.set_url("http://" + header.get_property(header_name::HOST) + line.get_url());
+        absolute.set_request_line(line);
+        rqst->set_written_header(absolute);
+    }
+}
+
+void proxy_server::tunnel_through_parent(connections_t::iterator conn, request_ptr rqst) {
+    prepare_parent_request(conn, rqst);
+    send(conn->get_server_registration(), rqst, conn, [this, conn]() {
+        response_ptr resp = make_shared_in<server_response>(memory_of(conn), memory_of(conn));
+        // Tunnel starts right after header of response
+        resp->set_bodyless(true);
+        read<response_header>(conn->get_server_registration(), resp, conn, [this, conn](response_ptr resp) {
+            int code = resp->get_header().get_request_line().get_code();
+            if (code < 200 || code >= 300) {
+                log(conn, "parent refused tunnel with " + std::to_string(code));
+                response_header refused(response_line(502, "Bad Gateway"));
+                refused.set_property(header_name::CONTENT_LENGTH, "0");
+                refused.set_property(header_name::CONNECTION, "close");
+                send(conn->get_client_registration(), std::make_shared<server_response>(refused, ""), conn,
+                     [this, conn]() {
+                         close(conn);
+                     });
+                return;
+            }
+            parents.report_success(conn->parent, elapsed_ms(conn->sent));
+            response_ptr established = std::make_shared<server_response>(
+                    response_header(response_line(200, "Connection Established")), "");
+            // Server may speak first in tunnel, its data can come together with the header
+            send(conn->get_client_registration(), established, conn, handle_connect(conn, resp->take_rest()));
+        });
+    });
+}
+
+void proxy_server::check_parents() {
+    for (size_t parent = 0; parent < config.parents.size(); parent++) {
+        endpoint const &address = config.parents[parent].address;
+        auto pending = parent_checks.find(parent);
+        if (pending != parent_checks.end()) {
+            log("parent " + to_string(address), "health check timed out");
+            parents.report_failure(parent);
+            close(pending->second);
+            parent_checks.erase(pending);
+        }
+
+        socket_wrap probe({socket_wrap::NONBLOCK, socket_wrap::CLOEXEC});
+        io_result connected = probe.try_connect(address);
+        if (connected.is_error()) {
+            log("parent " + to_string(address), connected.get_exception("health check").what());
+            parents.report_failure(parent);
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        sockets_t::iterator it = save_registration(epoll_registration(epoll, std::move(probe), fd_state::OUT),
+                                                   INFINITE_TIMEOUT);
+        parent_checks[parent] = it;
+        it->second.update([this, parent, it, start](fd_state state) {
+            endpoint const &address = this->config.parents[parent].address;
+            if (state.is({fd_state::HUP, fd_state::ERROR})) {
+                log("parent " + to_string(address), "health check failed");
+                parents.report_failure(parent);
+            } else if (state.is(fd_state::OUT)) {
+                bool was_healthy = parents.is_healthy(parent);
+                parents.report_success(parent, elapsed_ms(start));
+                if (!was_healthy) {
+                    log("parent " + to_string(address), "is healthy again");
+                }
+            }
+            parent_checks.erase(parent);
+            close(it);
+        });
+    }
+}
+
+double proxy_server::elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+void proxy_server::fetch_from_origin(connections_t::iterator conn, request_ptr rqst) {
+    sockets_t::iterator client = escape_client(conn);
+    close(conn);
+    connect_to_server(client, rqst, handle_client_request(rqst));
+}
+
+void proxy_server::connect_to_ip(resolved_ip_t ip) {
+    socket_wrap destination(socket_wrap::NONBLOCK);
+
+    on_resolve_t::iterator it = on_resolve.find({ip.get_extra().socket, ip.get_extra().host});
+    sockets_t::iterator client = sockets.find(ip.get_extra().socket);
+    if (it == on_resolve.end()) {
+        // Client disconnected during resolving of ip
+        log(client, "client disconnected during resolving of ip");
+        return;
+    }
 
-    rt.resolve_host(host, notifier->second.get_fd(), {s.get(), host});
+    if (!ip.has_ip()) {
+        log(client,
+            "address " + ip.get_extra().host + " not found");
+        fail_connecting(it, client);
+        return;
+    }
+
+    io_result connected = destination.try_connect(ip.get_ip());
+    if (connected.is_error()) {
+        log(connected.get_exception("connect"));
+        fail_connecting(it, client);
+        return;
+    }
+
+    connection conn(std::move(client->second),
+                    epoll_registration(epoll, std::move(destination), fd_state::OUT),
+                    SHORT_SOCKET_TIMEOUT, ticks, client->second.memory);
+
+    sockets.erase(client);
+    log(conn, "ip for " + ip.get_extra().host + " resolved: " + to_string(ip.get_ip()));
+
+    connections_t::iterator conn_it = save_connection(std::move(conn));
+
+    resolver_extra ip_extra = ip.get_extra();
+    conn_it->get_client_registration()
+            .update(fd_state::RDHUP,
+                    [this, ip_extra, conn_it](fd_state state) {
+                        // If client disconnect while we haven't connected to server
+                        if (state.is(fd_state::RDHUP)) {
+                            log(conn_it, "client dropped connection");
+                            auto it = on_resolve.find({ip_extra.socket, ip_extra.host});
+                            if (it != on_resolve.end()) {
+                                on_resolve.erase(it);
+                            }
+                            close(conn_it);
+                        }
+                    });
+
+    conn_it->get_server_registration().update(make_server_connect_handler(conn_it, ip));
 }
 
-proxy_server::action_with_connection proxy_server::handle_client_request(client_request rqst) {
+proxy_server::action_with_connection proxy_server::handle_client_request(request_ptr rqst) {
     return [this, rqst](connections_t::iterator conn) {
-        if (rqst.get_header().get_request_line().get_type() == request_line::GET) {
+        request_header const &header = rqst->get_header();
+        request_line::request_type type = header.get_request_line().get_type();
+        // Request with body that isn't read yet is only forwarded
+        if ((type == request_line::GET || type == request_line::HEAD) && rqst->is_read()) {
+            popularity.increment(to_url(header));
+
+            // If cached, send it if it's fresh or validate
+            entry_ptr cached = get_cached(header);
+            if (is_only_if_cached(header) && !(cached && get_freshness(*cached).is_fresh())) {
+                // Client (E.G. peer) asks not to go to server
+                log(conn, "no fresh cached for " + keys.get_url(header) + ", only cached is asked");
+                response_header timeout(response_line(504, "Gateway Timeout"));
+                timeout.set_property(header_name::CONTENT_LENGTH, "0");
+                send_server_response(conn, rqst, std::make_shared<server_response>(timeout, ""));
+                return;
+            }
+            if (cached) {
+                freshness fresh = get_freshness(*cached);
 
-            // If cached, validate
-            if (is_cached(rqst.get_header())) {
-                log(conn, "found cached for " + to_url(rqst.get_header()) + ", validating...");
+                if (fresh.is_fresh()) {
+                    send_fresh(conn, rqst, cached);
+                    return;
+                }
+                if (type == request_line::HEAD) {
+                    // Validation sends cached body, HEAD is forwarded instead
+                    fast_transfer(conn, rqst);
+                    return;
+                }
+                if (fresh.can_revalidate_in_background()) {
+                    log(conn, "found stale cached for " + keys.get_url(header) + ", revalidating in background");
+                    revalidate_in_background(conn, rqst, cached);
+                    return;
+                }
 
-                server_response cached = get_cached(rqst.get_header());
-                send_and_read(conn->get_server_registration(),
-                              make_validate_request(rqst.get_header(), cached.get_header()),
-                              conn, handle_validation_response(conn, rqst, cached));
+                log(conn, "found cached for " + keys.get_url(header) + ", validating...");
+                request_ptr validate = make_validate_request(header, *cached);
+                prepare_parent_request(conn, validate);
+                send_and_read(conn->get_server_registration(), validate, conn, handle_validation_response(conn, rqst, cached),
+                              [this, conn, rqst]() {
+                                  log(conn, "validation failed");
+                                  sockets_t::iterator client = escape_client(conn);
+                                  close(conn);
+                                  send_stale_or_404(client, rqst);
+                              });
                 return;
             }
         }
-        if (rqst.get_header().get_request_line().get_type() == request_line::CONNECT) {
-            server_response resp(response_header(response_line(200, "Connection Established")), "");
+        if (type == request_line::CONNECT) {
+            if (conn->parent != upstream_pool::NONE) {
+                tunnel_through_parent(conn, rqst);
+                return;
+            }
+            response_ptr resp = std::make_shared<server_response>(
+                    response_header(response_line(200, "Connection Established")), "");
             send(conn->get_client_registration(), resp, conn, handle_connect(conn));
             return;
         }
@@ -180,36 +791,40 @@ proxy_server::action_with_connection proxy_server::handle_client_request(client_
 }
 
 proxy_server::action_with_response proxy_server::handle_validation_response(connections_t::iterator conn,
-                                                                            client_request rqst,
-                                                                            server_response cached) {
-    return [this, rqst, conn, cached](server_response resp) mutable {
-        int code = resp.get_header().get_request_line().get_code();
+                                                                            request_ptr rqst,
+                                                                            entry_ptr cached) {
+    return [this, rqst, conn, cached](response_ptr resp) {
+        response_header const &header = resp->get_header();
+        int code = header.get_request_line().get_code();
 
         if (code == 200 || code == 304) {
             // Can send cached
             log(conn, "cache valid");
-            if (resp.get_header().has_property("connnection")) {
-                cached.get_header().set_property("connection", resp.get_header().get_property("connection"));
+
+            if (code == 304) {
+                refresh_cached(rqst->get_header(), header, cached);
             }
+            send_cached(conn, rqst, cached);
+        } else if (code >= 500 && get_freshness(*cached).can_serve_on_error()) {
+            log(conn, "server error " + std::to_string(code) + ", sending stale cached");
 
-            send_server_response(conn, std::move(rqst), std::move(cached));
+            send_cached(conn, rqst, cached);
         } else {
             // Can't do it
             log(conn, "cache invalid");
 
-            delete_cached(rqst.get_header());
+            delete_cached(rqst->get_header());
 
             // Send data to server
-            if (resp.get_header().has_property("connection") &&
-                to_lower(resp.get_header().get_property("connection")).compare("close") == 0) {
+            if (header.has_property(header_name::CONNECTION) &&
+                to_lower(header.get_property(header_name::CONNECTION)).compare("close") == 0) {
                 // Re-connect if closed
                 log(conn, "server closed due to \"Connection = close\", reconnecting");
                 epoll_registration client = std::move(conn->get_client_registration());
+                sockets_t::iterator it = save_registration(std::move(client), LONG_SOCKET_TIMEOUT, conn->memory);
                 close(conn);
-                sockets_t::iterator it = save_registration(std::move(client), LONG_SOCKET_TIMEOUT);
 
-                connect_to_server(it,
-                                  rqst.get_header().get_property("host"),
+                connect_to_server(it, rqst,
                                   [this, rqst](connections_t::iterator conn) {
                                       fast_transfer(conn, rqst);
                                   });
@@ -221,10 +836,11 @@ proxy_server::action_with_response proxy_server::handle_validation_response(conn
 }
 
 
-proxy_server::action proxy_server::reuse_connection(connections_t::iterator conn, std::string old_host) {
-    return [this, conn, old_host]() {
+proxy_server::action proxy_server::reuse_connection(connections_t::iterator conn, request_ptr previous) {
+    return [this, conn, previous]() {
         log(conn, "server response sent");
         log(conn, "kept alive");
+        conn->load = load_lease();
 
         conn->get_server_registration().update(fd_state::RDHUP, [this, conn](fd_state state) {
             // It's a rare situation when server that keeps connection alive drops it
@@ -236,35 +852,52 @@ proxy_server::action proxy_server::reuse_connection(connections_t::iterator conn
             }
         });
 
-        // Read client request
-        read < request_header > (conn->get_client_registration(), client_request(), conn,
-                [this, conn, old_host](client_request rqst) {
+        std::string old_host = previous->get_header().get_property(header_name::HOST);
+        action_with_request handle_next = [this, conn, old_host](request_ptr rqst) {
+            std::string host = rqst->get_header().get_property(header_name::HOST);
+            log(conn, "client reused: " + old_host + " -> " + host);
 
-                    std::string host = rqst.get_header().get_property("host");
-                    log(conn, "client reused: " + old_host + " -> " + host);
+            if (host.compare(old_host) == 0 && conn->upstream.empty() && !should_ask_peers(*rqst)) {
+                // If host the same, handle request
+                handle_client_request(std::move(rqst))(conn);
+            } else {
+                // Otherwise, disconnect, connect and send
+                log(conn, "disconnect from " + (conn->upstream.empty() ? old_host : conn->upstream));
+                epoll_registration client = std::move(conn->get_client_registration());
+                sockets_t::iterator it = save_registration(std::move(client), LONG_SOCKET_TIMEOUT, conn->memory);
+                close(conn);
 
-                    if (host.compare(old_host) == 0) {
-                        // If host the same, handle request
-                        handle_client_request(std::move(rqst))(conn);
-                    } else {
-                        // Otherwise, disconnect, connect and send
-                        log(conn, "disconnect from " + old_host);
-                        epoll_registration client = std::move(conn->get_client_registration());
-                        close(conn);
+                start_request(it, std::move(rqst));
+            }
+        };
 
-                        sockets_t::iterator it = save_registration(std::move(client), LONG_SOCKET_TIMEOUT);
-                        connect_to_server(it, host, handle_client_request(std::move(rqst)));
-                    }
-                });
+        // Cycles take two arenas in turn: next request is read into the other one, so arena of previous cycle
+        // gives its blocks back to heap as soon as its objects are freed
+        swap(conn->memory, conn->spare);
+        if (!conn->memory) {
+            conn->memory = std::make_shared<arena>((size_t) ARENA_BLOCK_SIZE);
+        }
+        request_ptr next = make_shared_in<client_request>(conn->memory, conn->memory);
+        if (previous->has_rest()) {
+            // Client sent next requests without waiting for response (pipelining). They are handled in order
+            next->read_from(previous->take_rest());
+            if (is_ready(*next)) {
+                log(conn, "pipelined request found");
+                handle_next(std::move(next));
+                return;
+            }
+        }
 
+        // Read client request
+        read<request_header>(conn->get_client_registration(), std::move(next), conn, std::move(handle_next));
     };
 }
 
-proxy_server::action proxy_server::handle_connect(connections_t::iterator conn) {
-    return [this, conn]() {
+proxy_server::action proxy_server::handle_connect(connections_t::iterator conn, std::string from_server) {
+    return [this, conn, from_server]() {
         log(conn, "CONNECT started");
         std::shared_ptr<raw_message> client_message = std::make_shared<raw_message>();
-        std::shared_ptr<raw_message> server_message = std::make_shared<raw_message>();
+        std::shared_ptr<raw_message> server_message = std::make_shared<raw_message>(from_server);
         conn->get_server_registration()
                 .update({fd_state::RDHUP, fd_state::IN, fd_state::OUT},
                         make_connect_transfer_handler(conn->get_server_registration(), server_message,
@@ -292,11 +925,11 @@ epoll_wrap::handler_t proxy_server::make_connect_transfer_handler(epoll_registra
         }
 
         if (state.is(fd_state::IN) && in_message->can_read()) {
-            try {
-                in_message->read_from(in.get_fd());
-            } catch (annotated_exception const& e) {
-                log(conn, e.what());
+            io_result res = in_message->read_from(in.get_fd());
+            if (res.is_error()) {
+                log(conn, res.get_exception("read").what());
                 close(conn);
+                return;
             }
             if (!in_message->can_read()) {
                 in.update(in.get_state() ^ fd_state::IN);
@@ -306,11 +939,11 @@ epoll_wrap::handler_t proxy_server::make_connect_transfer_handler(epoll_registra
             }
         }
         if (state.is(fd_state::OUT) && out_message->can_write()) {
-            try {
-                out_message->write_to(in.get_fd());
-            } catch (annotated_exception const& e) {
-                log(conn, e.what());
+            io_result res = out_message->write_to(in.get_fd());
+            if (res.is_error()) {
+                log(conn, res.get_exception("write").what());
                 close(conn);
+                return;
             }
             if (!out_message->can_write()) {
                 in.update(in.get_state() ^ fd_state::OUT);
@@ -331,8 +964,7 @@ epoll_wrap::handler_t proxy_server::make_server_connect_handler(connections_t::i
         if (state.is(fd_state::RDHUP)) {
             log(conn, "connection to " + ip.get_extra().host +
                       ": server " + std::to_string(server.get()) + "dropped connection");
-            on_resolve.erase(query);
-            send_404(escape_client(conn));
+            fail_connecting(query, escape_client(conn));
             close(conn);
             return;
         }
@@ -348,8 +980,7 @@ epoll_wrap::handler_t proxy_server::make_server_connect_handler(connections_t::i
                 ip.next_ip();
                 if (!ip.has_ip()) {
                     log(conn, "connection to " + ip.get_extra().host + ": no relevant ip, closing");
-                    on_resolve.erase(query);
-                    send_404(escape_client(conn));
+                    fail_connecting(query, escape_client(conn));
                     close(conn);
                     return;
                 }
@@ -357,24 +988,19 @@ epoll_wrap::handler_t proxy_server::make_server_connect_handler(connections_t::i
                           + to_string(old_ip) + " isn't valid. Trying " + to_string(ip.get_ip()));
                 endpoint cur_ip = ip.get_ip();
 
-                try {
-                    server.connect(cur_ip);
-                } catch (annotated_exception const &e) {
-                    if (e.get_errno() != EINPROGRESS) {
-                        // bad error
-                        log(e);
-                        log(conn, "closing");
-                        on_resolve.erase(query);
-                        send_404(escape_client(conn));
-                        close(conn);
-                        return;
-                    }
+                io_result connected = server.try_connect(cur_ip);
+                if (connected.is_error()) {
+                    // bad error
+                    log(connected.get_exception("connect"));
+                    log(conn, "closing");
+                    fail_connecting(query, escape_client(conn));
+                    close(conn);
+                    return;
                 }
                 return;
             } else {
                 log(e);
-                on_resolve.erase(query);
-                send_404(escape_client(conn));
+                fail_connecting(query, escape_client(conn));
                 close(conn);
                 return;
             }
@@ -383,7 +1009,7 @@ epoll_wrap::handler_t proxy_server::make_server_connect_handler(connections_t::i
         if (state.is(fd_state::OUT)) {
             log(conn, "established");
 
-            action_with_connection action = query->second;
+            action_with_connection action = std::move(query->second.next);
             on_resolve.erase(query);
 
             conn->get_client_registration().update(fd_state::WAIT);
@@ -397,22 +1023,21 @@ epoll_wrap::handler_t proxy_server::make_server_connect_handler(connections_t::i
 
 typename proxy_server::sockets_t::iterator proxy_server::escape_client(connections_t::iterator conn) {
     epoll_registration client = std::move(conn->get_client_registration());
-    return save_registration(std::move(client), SHORT_SOCKET_TIMEOUT);
+    return save_registration(std::move(client), SHORT_SOCKET_TIMEOUT, conn->memory);
 }
 
 template<typename T, typename C>
-void proxy_server::read(epoll_registration &from, buffered_message<T> message,
-                        C iterator, action_with<buffered_message<T>> next) {
-    std::shared_ptr<buffered_message<T>> s_message = std::make_shared<buffered_message<T>>(std::move(message));
+void proxy_server::read(epoll_registration &from, std::shared_ptr<buffered_message<T>> s_message,
+                        C iterator, action_with<std::shared_ptr<buffered_message<T>>> next, action on_error) {
     from.update({fd_state::IN, fd_state::RDHUP},
-                [this, &from, s_message, iterator, next](fd_state state) {
+                [this, &from, s_message, iterator, next, on_error](fd_state state) {
                     file_descriptor const &fd = from.get_fd();
                     set_active(iterator);
 
                     if (state.is(fd_state::RDHUP)) {
                         if (fd.can_read() == 0) {
                             log(iterator, "disconnected");
-                            close(iterator);
+                            fail(iterator, on_error);
                             return;
                         }
                     }
@@ -425,37 +1050,44 @@ void proxy_server::read(epoll_registration &from, buffered_message<T> message,
                         annotated_exception exception(to_string(iterator) + " read", code);
 
                         log(exception);
-                        close(iterator);
+                        fail(iterator, on_error);
+                        return;
                     }
 
                     if (state.is(fd_state::IN)) {
+                        io_result res;
                         try {
-                            s_message->read_from(fd);
+                            res = s_message->read_from(fd);
                         } catch (annotated_exception const &e) {
+                            // Malformed message
                             log(iterator, e.what());
-                            close(iterator);
+                            fail(iterator, on_error);
+                            return;
+                        }
+                        if (res.is_error()) {
+                            log(iterator, res.get_exception("read").what());
+                            fail(iterator, on_error);
                             return;
                         }
-                        if (s_message->is_read()) {
+                        if (is_ready(*s_message)) {
                             from.update(fd_state::WAIT);
-                            next(std::move(*s_message));
+                            next(s_message);
                         }
                     }
                 });
 }
 
 template<typename T, typename C>
-void proxy_server::send(epoll_registration &to, buffered_message<T> message,
-                        C iterator, action next) {
-    std::shared_ptr<buffered_message<T>> s_message = std::make_shared<buffered_message<T>>(std::move(message));
+void proxy_server::send(epoll_registration &to, std::shared_ptr<buffered_message<T>> s_message,
+                        C iterator, action next, action on_error) {
     to.update({fd_state::OUT, fd_state::RDHUP},
-              [this, &to, s_message, iterator, next](fd_state state) {
+              [this, &to, s_message, iterator, next, on_error](fd_state state) {
                   file_descriptor const &fd = to.get_fd();
                   set_active(iterator);
 
                   if (state.is(fd_state::RDHUP)) {
                       log(iterator, "disconnected");
-                      close(iterator);
+                      fail(iterator, on_error);
                       return;
                   }
 
@@ -466,15 +1098,15 @@ void proxy_server::send(epoll_registration &to, buffered_message<T> message,
                       sock.get_option(SO_ERROR, &code, &size);
                       annotated_exception exception(to_string(iterator) + " send", code);
                       log(exception);
-                      close(iterator);
+                      fail(iterator, on_error);
+                      return;
                   }
 
                   if (state.is(fd_state::OUT)) {
-                      try {
-                          s_message->write_to(fd);
-                      } catch (annotated_exception const &e) {
-                          log(iterator, e.what());
-                          close(iterator);
+                      io_result res = s_message->write_to(fd);
+                      if (res.is_error()) {
+                          log(iterator, res.get_exception("write").what());
+                          fail(iterator, on_error);
                           return;
                       }
 
@@ -487,18 +1119,29 @@ void proxy_server::send(epoll_registration &to, buffered_message<T> message,
 }
 
 template<typename C>
-void proxy_server::send_and_read(epoll_registration &to, client_request rqst,
-                                 C iterator, action_with_response next) {
-    send(to, rqst, iterator, [this, &to, iterator, next]() {
+void proxy_server::fail(C iterator, action const &on_error) {
+    if (on_error) {
+        on_error();
+    } else {
+        close(iterator);
+    }
+}
+
+template<typename C>
+void proxy_server::send_and_read(epoll_registration &to, request_ptr rqst,
+                                 C iterator, action_with_response next, action on_error) {
+    send(to, std::move(rqst), iterator, [this, &to, iterator, next, on_error]() {
         log(iterator, "request sent");
-        read(to, server_response(), iterator, next);
-    });
+        read(to, make_shared_in<server_response>(memory_of(iterator), memory_of(iterator)), iterator, next,
+             on_error);
+    }, on_error);
 }
 
-void proxy_server::send_server_response(connections_t::iterator conn, client_request rqst, server_response resp) {
+void proxy_server::send_server_response(connections_t::iterator conn, request_ptr rqst, response_ptr resp) {
     log(conn, "server's response read");
-    bool closed = resp.get_header().has_property("connection") &&
-                  to_lower(resp.get_header().get_property("connection")).compare("close") == 0;
+    response_header const &header = resp->get_header();
+    bool closed = header.has_property(header_name::CONNECTION) &&
+                  to_lower(header.get_property(header_name::CONNECTION)).compare("close") == 0;
 
     if (closed) {
         log(conn, "server closed due to \"Connection = close\" ");
@@ -513,29 +1156,405 @@ void proxy_server::send_server_response(connections_t::iterator conn, client_req
     } else {
         conn->get_server_registration().update(fd_state::WAIT);
         send(conn->get_client_registration(), std::move(resp), conn,
-             reuse_connection(conn, rqst.get_header().get_property("host")));
+             reuse_connection(conn, std::move(rqst)));
     }
 
 }
 
-void proxy_server::send_404(sockets_t::iterator client) {
-    response_header header(response_line(404, "Not Found"));
-
-    server_response response(std::move(header), "");
-    send(client->second, std::move(response), client, [this, client]() {
-        close(client);
-    });
+void proxy_server::send_fresh(connections_t::iterator conn, request_ptr rqst, entry_ptr cached) {
+    request_header const &header = rqst->get_header();
+    // Client that already has the response or asks only for header gets no body
+    if (cached->matches_conditions(header)) {
+        log(conn, "cached for " + keys.get_url(header) + " not modified");
+        send_server_response(conn, rqst, std::make_shared<server_response>(cached->get_not_modified_header(), ""));
+    } else if (header.get_request_line().get_type() == request_line::HEAD) {
+        log(conn, "found fresh cached header for " + keys.get_url(header));
+        send_server_response(conn, rqst, std::make_shared<server_response>(cached->header, ""));
+    } else {
+        log(conn, "found fresh cached for " + keys.get_url(header));
+        send_cached(conn, rqst, cached);
+    }
 }
 
-void proxy_server::fast_transfer(connections_t::iterator conn, client_request rqst) {
-    send(conn->get_server_registration(), rqst, conn, [this, conn, rqst]() {
-        std::shared_ptr<client_request> s_rqst = std::make_shared<client_request>(std::move(rqst));
-        std::shared_ptr<server_response> resp = std::make_shared<server_response>(server_response());
+bool proxy_server::send_from_cache(sockets_t::iterator client, request_ptr rqst) {
+    request_header const &header = rqst->get_header();
+    request_line::request_type type = header.get_request_line().get_type();
+    if ((type != request_line::GET && type != request_line::HEAD) || !rqst->is_read()) {
+        return false;
+    }
+    entry_ptr cached = get_cached(header);
+    if (!cached || !get_freshness(*cached).is_fresh()) {
+        if (!is_only_if_cached(header)) {
+            return false;
+        }
+        // Client (E.G. peer) asks not to go to server
+        log(client, "no fresh cached for " + keys.get_url(header) + ", only cached is asked");
+        response_header timeout(response_line(504, "Gateway Timeout"));
+        timeout.set_property(header_name::CONTENT_LENGTH, "0");
+        send(client->second, std::make_shared<server_response>(timeout, ""), client, [this, client, rqst]() {
+            read_next_request(client, rqst);
+        });
+        return true;
+    }
+    popularity.increment(to_url(header));
 
-        conn->get_server_registration().update(
-                {fd_state::IN, fd_state::RDHUP}, [this, conn, s_rqst, resp](fd_state state) {
-            set_active(conn);
-            file_descriptor const &server = conn->get_server();
+    action next = [this, client, rqst]() {
+        read_next_request(client, rqst);
+    };
+    // Same answers as send_fresh gives, but server isn't connected at all
+    if (cached->matches_conditions(header)) {
+        log(client, "cached for " + keys.get_url(header) + " not modified");
+        send(client->second, std::make_shared<server_response>(cached->get_not_modified_header(), ""), client, next);
+    } else if (type == request_line::HEAD) {
+        log(client, "found fresh cached header for " + keys.get_url(header));
+        send(client->second, std::make_shared<server_response>(cached->header, ""), client, next);
+    } else if (can_send_zerocopy(header, *cached)) {
+        log(client, "found fresh cached for " + keys.get_url(header));
+        send_zerocopy(client->second, client, cached, next);
+    } else {
+        log(client, "found fresh cached for " + keys.get_url(header));
+        send(client->second, select_ranges(header, *cached), client, next);
+    }
+    return true;
+}
+
+void proxy_server::read_next_request(sockets_t::iterator client, request_ptr previous) {
+    request_header const &header = previous->get_header();
+    if (header.has_property(header_name::CONNECTION) &&
+        to_lower(header.get_property(header_name::CONNECTION)).compare("close") == 0) {
+        log(client, "closed due to \"Connection = close\"");
+        close(client);
+        return;
+    }
+
+    request_ptr next = make_shared_in<client_request>(memory_of(client), memory_of(client));
+    if (previous->has_rest()) {
+        // Pipelined requests are handled in order
+        next->read_from(previous->take_rest());
+        if (is_ready(*next)) {
+            start_request(client, std::move(next));
+            return;
+        }
+    }
+    read(client->second, std::move(next), client, first_request_read(client));
+}
+
+void proxy_server::send_cached(connections_t::iterator conn, request_ptr rqst, entry_ptr cached) {
+    request_header const &header = rqst->get_header();
+    if (can_send_zerocopy(header, *cached)) {
+        conn->get_server_registration().update(fd_state::WAIT);
+        send_zerocopy(conn->get_client_registration(), conn, cached, [this, conn, rqst, cached]() {
+            // Response is sent, finish it as usual
+            send_server_response(conn, rqst, std::make_shared<server_response>(cached_message(), cached->header));
+        });
+        return;
+    }
+    send_server_response(conn, rqst, select_ranges(header, *cached));
+}
+
+bool proxy_server::can_send_zerocopy(request_header const &request, cache_entry const &cached) const {
+    return config.zerocopy_threshold != 0 && cached.get_size() >= config.zerocopy_threshold &&
+           !request.has_property(header_name::RANGE);
+}
+
+template<typename C>
+void proxy_server::send_zerocopy(epoll_registration &to, C iterator, entry_ptr cached, action next) {
+    int fd = to.get_fd().get();
+    if (zerocopy.find(fd) == zerocopy.end()) {
+        zerocopy_tracker &tracker = zerocopy[fd];
+        if (tracker.enable(fd)) {
+            epoll.set_error_queue_handler(to.get_fd(), [this, fd]() {
+                std::map<int, zerocopy_tracker>::iterator it = zerocopy.find(fd);
+                return it != zerocopy.end() && it->second.handle_completions(fd);
+            });
+        }
+    }
+    log(iterator, "sending " + std::to_string(cached->get_size()) + " cached bytes with zero-copy");
+
+    // Parts of cached message are sent as they are, entry is pinned by every send until kernel completes it
+    size_t part = 0, offset = 0;
+    to.update({fd_state::OUT, fd_state::RDHUP},
+              [this, &to, iterator, cached, next, part, offset](fd_state state) mutable {
+        file_descriptor const &client = to.get_fd();
+        set_active(iterator);
+
+        if (state.is(fd_state::RDHUP)) {
+            log(iterator, "client dropped connection");
+            close(iterator);
+            return;
+        }
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&client);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(iterator) + " send", code);
+            log(exception);
+            close(iterator);
+            return;
+        }
+
+        if (state.is(fd_state::OUT)) {
+            std::string const &data = cached->message[part];
+            io_result res = zerocopy[client.get()].send(client.get(), data.data() + offset, data.length() - offset,
+                                                        cached);
+            if (res.is_error()) {
+                log(iterator, res.get_exception("send").what());
+                close(iterator);
+                return;
+            }
+            if (res.is_ok()) {
+                offset += res.get();
+                if (offset == data.length()) {
+                    part++;
+                    offset = 0;
+                }
+            }
+
+            if (part == cached->message.size()) {
+                log(iterator, "cached response sent, " + std::to_string(zerocopy[client.get()].get_pending()) +
+                              " zero-copy sends aren't completed yet");
+                to.update(fd_state::WAIT);
+                next();
+            }
+        }
+    });
+}
+
+void proxy_server::release_zerocopy(int fd) {
+    std::map<int, zerocopy_tracker>::iterator it = zerocopy.find(fd);
+    if (it == zerocopy.end()) {
+        return;
+    }
+    // Completions that came already are read, others can't be read after closing
+    it->second.handle_completions(fd);
+    std::vector<zerocopy_tracker::pin_t> pins = it->second.take_pins();
+    for (auto pin = pins.begin(); pin != pins.end(); pin++) {
+        zerocopy_orphans.emplace_back(ticks + LONG_SOCKET_TIMEOUT, std::move(*pin));
+    }
+    zerocopy.erase(it);
+}
+
+void proxy_server::send_404(sockets_t::iterator client) {
+    response_header header(response_line(404, "Not Found"));
+
+    response_ptr response = std::make_shared<server_response>(std::move(header), "");
+    send(client->second, std::move(response), client, [this, client]() {
+        close(client);
+    });
+}
+
+void proxy_server::send_stale_or_404(sockets_t::iterator client, request_ptr rqst) {
+    request_header const &header = rqst->get_header();
+    entry_ptr cached = header.get_request_line().get_type() == request_line::GET ? get_cached(header) : nullptr;
+    if (cached) {
+        if (get_freshness(*cached).can_serve_on_error()) {
+            log(client, "server failed, sending stale cached for " + keys.get_url(header));
+            send(client->second, select_ranges(header, *cached), client, [this, client]() {
+                close(client);
+            });
+            return;
+        }
+    }
+    send_404(client);
+}
+
+void proxy_server::revalidate_in_background(connections_t::iterator conn, request_ptr rqst, entry_ptr cached) {
+    conn->get_server_registration().update(fd_state::WAIT);
+    send(conn->get_client_registration(), select_ranges(rqst->get_header(), *cached), conn,
+         [this, conn, rqst, cached]() {
+        // Client has the response, next request is read after validation
+        log(conn, "stale cached sent");
+
+        request_ptr validate = make_validate_request(rqst->get_header(), *cached);
+        prepare_parent_request(conn, validate);
+        send_and_read(conn->get_server_registration(), validate,
+                      conn, [this, conn, rqst, cached](response_ptr resp) {
+                    response_header const &header = resp->get_header();
+                    int code = header.get_request_line().get_code();
+
+                    if (code == 304) {
+                        log(conn, "cache revalidated");
+                        refresh_cached(rqst->get_header(), header, cached);
+                    } else if (code == 200 && should_cache(header)) {
+                        log(conn, "cache replaced");
+                        delete_cached(rqst->get_header());
+                        add_encoding_vary(*resp);
+                        save_cached(add_variant(rqst->get_header(), header),
+                                    make_entry(resp->get_cache(), header));
+                    } else if (code < 500) {
+                        log(conn, "cache invalid");
+                        delete_cached(rqst->get_header());
+                    }
+
+                    if (header.has_property(header_name::CONNECTION) &&
+                        to_lower(header.get_property(header_name::CONNECTION)).compare("close") == 0) {
+                        log(conn, "server closed due to \"Connection = close\"");
+                        close(conn);
+                        return;
+                    }
+                    reuse_connection(conn, rqst)();
+                });
+    });
+}
+
+bool proxy_server::is_ready(client_request const &rqst) {
+    return rqst.is_header_read();
+}
+
+bool proxy_server::is_ready(server_response const &resp) {
+    return resp.is_read();
+}
+
+void proxy_server::send_request(connections_t::iterator conn, request_ptr rqst, action next) {
+    request_header header = rqst->get_header();
+    bool expects = header.has_property(header_name::EXPECT) &&
+                   to_lower(header.get_property(header_name::EXPECT)).compare("100-continue") == 0;
+    if (expects) {
+        // Proxy permits sending of body itself, because it's streamed through bounded buffers anyway.
+        // Server doesn't get the expectation, so it won't send interim response
+        header.erase_property(header_name::EXPECT);
+        rqst->set_header(header);
+    }
+    prepare_parent_request(conn, rqst);
+    if (!expects || rqst->is_read()) {
+        stream_request(conn, rqst, next);
+        return;
+    }
+
+    log(conn, "client expects 100-continue");
+    response_ptr permission = std::make_shared<server_response>(response_header(response_line(100, "Continue")), "");
+    send(conn->get_client_registration(), permission, conn, [this, conn, rqst, next]() {
+        stream_request(conn, rqst, next);
+    });
+}
+
+void proxy_server::stream_request(connections_t::iterator conn, request_ptr rqst, action next) {
+    if (rqst->is_read()) {
+        send(conn->get_server_registration(), rqst, conn, next);
+        return;
+    }
+
+    // Body isn't needed after it's sent, so at most HIGH_WATERMARK bytes of it are kept
+    log(conn, "streaming request body");
+    rqst->set_cache_enabled(false);
+
+    conn->get_server_registration().update({fd_state::OUT, fd_state::RDHUP}, [this, conn, rqst, next](fd_state state) {
+        file_descriptor const &server = conn->get_server();
+        set_active(conn);
+
+        if (state.is(fd_state::RDHUP)) {
+            log(conn, "server dropped connection during upload");
+            close(conn);
+            return;
+        }
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&server);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(conn) + " send", code);
+            log(exception);
+            close(conn);
+            return;
+        }
+
+        if (state.is(fd_state::OUT) && rqst->can_write()) {
+            io_result res = rqst->write_to(server);
+            if (res.is_error()) {
+                log(conn, res.get_exception("write").what());
+                close(conn);
+                return;
+            }
+            if (!rqst->can_write()) {
+                conn->get_server_registration().update(conn->get_server_registration().get_state() ^ fd_state::OUT);
+            }
+            if (!rqst->is_read() && rqst->get_unsent_length() <= LOW_WATERMARK) {
+                // Server caught up, continue reading from client
+                conn->get_client_registration().update({fd_state::IN, fd_state::RDHUP});
+            }
+        }
+
+        if (rqst->is_written()) {
+            log(conn, "request sent");
+            conn->get_server_registration().update(fd_state::WAIT);
+            next();
+        }
+    });
+
+    conn->get_client_registration().update({fd_state::IN, fd_state::RDHUP}, [this, conn, rqst](fd_state state) {
+        file_descriptor const &client = conn->get_client();
+        set_active(conn);
+
+        if (state.is(fd_state::RDHUP)) {
+            if (client.can_read() == 0) {
+                log(conn, "client dropped connection during upload");
+                close(conn);
+                return;
+            }
+        }
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&client);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(conn) + " read", code);
+            log(exception);
+            close(conn);
+            return;
+        }
+
+        if (state.is(fd_state::IN)) {
+            io_result res;
+            try {
+                res = rqst->read_from(client);
+            } catch (annotated_exception const &e) {
+                // Malformed message
+                log(conn, e.what());
+                close(conn);
+                return;
+            }
+            if (res.is_error()) {
+                log(conn, res.get_exception("read").what());
+                close(conn);
+                return;
+            }
+
+            if (rqst->can_write()) {
+                conn->get_server_registration().update({fd_state::OUT, fd_state::RDHUP});
+            }
+            if (rqst->is_read() || rqst->get_unsent_length() >= HIGH_WATERMARK) {
+                // Whole body is read or server is too slow, stop reading until it receives the data
+                conn->get_client_registration().update(fd_state::WAIT);
+            }
+        }
+    });
+}
+
+void proxy_server::fast_transfer(connections_t::iterator conn, request_ptr rqst) {
+    send_request(conn, rqst, [this, conn, rqst]() {
+        if (conn->parent != upstream_pool::NONE) {
+            // Latency of parent doesn't include time of uploading body
+            conn->sent = std::chrono::steady_clock::now();
+        }
+        request_ptr s_rqst = rqst;
+        response_ptr resp = make_shared_in<server_response>(conn->memory, conn->memory);
+        response_ptr out = resp;        // What client receives, differs from resp if it's compressed
+        std::shared_ptr<body_compressor> compressor;
+        request_line::request_type type = rqst->get_header().get_request_line().get_type();
+        // Response to HEAD has header of GET response, but no body
+        resp->set_bodyless(type == request_line::HEAD);
+        // Only GET responses are cached. Member of cluster that sent response keeps it itself
+        bool store = type == request_line::GET && conn->upstream.empty();
+
+        conn->get_server_registration().update(
+                {fd_state::IN, fd_state::RDHUP},
+                [this, conn, s_rqst, resp, out, compressor, store](fd_state state) mutable {
+            set_active(conn);
+            file_descriptor const &server = conn->get_server();
 
             if (state.is(fd_state::RDHUP)) {
                 if (server.can_read() == 0) {
@@ -553,74 +1572,306 @@ void proxy_server::fast_transfer(connections_t::iterator conn, client_request rq
                 annotated_exception exception(to_string(conn) + " send", code);
                 log(exception);
                 close(conn);
+                return;
             }
 
             if (state.is(fd_state::IN)) {
+                bool header_was_read = resp->is_header_read();
+                io_result res;
                 try {
-                    resp->read_from(server);
+                    res = resp->read_from(server);
                 } catch (annotated_exception const &e) {
+                    // Malformed message
                     log(conn, e.what());
                     close(conn);
                     return;
                 }
+                if (res.is_error()) {
+                    log(conn, res.get_exception("read").what());
+                    close(conn);
+                    return;
+                }
 
-                if (resp->can_write()) {
+                if (!header_was_read && resp->is_header_read()) {
+                    if (conn->parent != upstream_pool::NONE) {
+                        parents.report_success(conn->parent, elapsed_ms(conn->sent));
+                    }
+                    if (!store || !should_cache(resp->get_header())) {
+                        // Response won't be cached, so we don't need to keep parts that are sent
+                        resp->set_cache_enabled(false);
+                    }
+
+                    compressor = make_compressor(s_rqst->get_header(), resp->get_header());
+                    if (compressor) {
+                        // Original response is only read, client receives compressed one
+                        log(conn, "compressing response with " + compressor->get_encoding());
+                        resp->set_cache_enabled(false);
+                        out = make_shared_in<server_response>(conn->memory, conn->memory);
+                        out->read_from(to_string(body_compressor::make_header(resp->get_header(),
+                                                                               compressor->get_encoding())));
+                        out->set_cache_enabled(should_cache(out->get_header()));
+                        conn->get_client_registration().update(make_response_writer(conn, out));
+                    } else {
+                        add_encoding_vary(*resp);
+                    }
+
+                    response_header const &header = resp->get_header();
+                    size_t body_left = resp->get_body_left();
+                    bool cached = store && should_cache(header);
+                    if (!compressor && !cached && config.splice_threshold != 0 && body_left != server_response::INF &&
+                        body_left >= config.splice_threshold) {
+                        // Nobody needs the body in user space
+                        std::shared_ptr<pipe_wrap> pipe;
+                        try {
+                            pipe = std::make_shared<pipe_wrap>();
+                        } catch (annotated_exception const &e) {
+                            log(conn, e.what());
+                        }
+                        if (pipe) {
+                            splice_body(conn, s_rqst, resp, pipe);
+                            return;
+                        }
+                    }
+                }
+
+                if (compressor) {
+                    std::string body;
+                    resp->write_to(body);
+                    if (!header_was_read) {
+                        body.erase(0, to_string(resp->get_header()).length());
+                    }
+                    try {
+                        compress(conn, *compressor, body, resp->is_read(), *out);
+                    } catch (annotated_exception const &e) {
+                        log(conn, e.what());
+                        close(conn);
+                        return;
+                    }
+                }
+
+                if (out->can_write()) {
                     conn->get_client_registration().update({fd_state::OUT, fd_state::RDHUP});
                 }
 
-                if (resp->is_read()) {
-                    std::string url = to_url(s_rqst->get_header());
-                    if (should_cache(resp->get_header())) {
-                        save_cached(url, resp->get_cache());
-                        log(conn, "response from " + url + " saved to cache");
+                if (!out->is_read() && out->get_unsent_length() >= HIGH_WATERMARK) {
+                    // Client is too slow, stop reading until it receives the data
+                    conn->get_server_registration().update(fd_state::WAIT);
+                }
+
+                if (out->is_read()) {
+                    response_header const &header = out->get_header();
+                    // Parts that can't be cached don't make whole entity either
+                    if (store && should_cache(header)) {
+                        if (header.get_request_line().get_code() == 206) {
+                            save_partial(add_variant(s_rqst->get_header(), header), out->get_cache());
+                        } else {
+                            save_cached(add_variant(s_rqst->get_header(), header),
+                                        make_entry(out->get_cache(), out->get_header()));
+                            log(conn, "response from " + keys.get_url(s_rqst->get_header()) + " saved to cache");
+                        }
                     }
 
-                    send_server_response(conn, std::move(*s_rqst), std::move(*resp));
+                    send_server_response(conn, s_rqst, out);
                 }
             }
         });
-        conn->get_client_registration().update(
-                {fd_state::WAIT, fd_state::RDHUP}, [this, conn, s_rqst, resp](fd_state state) {
-            file_descriptor const &fd = conn->get_client();
-            set_active(conn);
+        conn->get_client_registration().update({fd_state::WAIT, fd_state::RDHUP}, make_response_writer(conn, resp));
+    });
+}
 
-            if (state.is(fd_state::RDHUP)) {
-                log(conn, "client dropped connection");
+epoll_wrap::handler_t proxy_server::make_response_writer(connections_t::iterator conn, response_ptr resp) {
+    return [this, conn, resp](fd_state state) {
+        file_descriptor const &fd = conn->get_client();
+        set_active(conn);
+
+        if (state.is(fd_state::RDHUP)) {
+            log(conn, "client dropped connection");
+            close(conn);
+            return;
+        }
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&fd);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(conn) + " send", code);
+            log(exception);
+            close(conn);
+            return;
+        }
+
+        if (state.is(fd_state::OUT) && resp->can_write()) {
+            io_result res = resp->write_to(fd);
+            if (res.is_error()) {
+                log(conn, res.get_exception("write").what());
                 close(conn);
                 return;
             }
+            if (!resp->can_write()) {
+                conn->get_client_registration().update(conn->get_client_registration().get_state() ^ fd_state::OUT);
+            }
+            if (!resp->is_read() && resp->get_unsent_length() <= LOW_WATERMARK) {
+                // Client caught up, continue reading from server
+                conn->get_server_registration().update({fd_state::IN, fd_state::RDHUP});
+            }
+        }
+    };
+}
 
-            if (state.is({fd_state::HUP, fd_state::ERROR})) {
-                int code;
-                socklen_t size = sizeof(code);
-                socket_wrap const &sock = *static_cast<socket_wrap const *>(&fd);
-                sock.get_option(SO_ERROR, &code, &size);
-                annotated_exception exception(to_string(conn) + " send", code);
-                log(exception);
+void proxy_server::splice_body(connections_t::iterator conn, request_ptr rqst, response_ptr resp,
+                               std::shared_ptr<pipe_wrap> pipe) {
+    log(conn, "splicing " + std::to_string(resp->get_body_left()) + " bytes of body");
+
+    conn->get_server_registration().update(
+            {fd_state::IN, fd_state::RDHUP}, [this, conn, resp, pipe](fd_state state) {
+        file_descriptor const &server = conn->get_server();
+        set_active(conn);
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&server);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(conn) + " splice", code);
+            log(exception);
+            close(conn);
+            return;
+        }
+
+        size_t length = std::min(resp->get_body_left(), pipe->get_space());
+        if (length == 0) {
+            // Event came before pausing took effect
+            conn->get_server_registration().update(fd_state::WAIT);
+            return;
+        }
+
+        if (state.is({fd_state::IN, fd_state::RDHUP})) {
+            io_result res = pipe->splice_from(server, length);
+            if (res.is_error()) {
+                log(conn, res.get_exception("splice").what());
                 close(conn);
+                return;
             }
-
-            if (state.is(fd_state::OUT) && resp->can_write()) {
-                try {
-                    resp->write_to(fd);
-                } catch (annotated_exception const &e) {
-                    log(conn, e.what());
+            if (res.is_ok()) {
+                if (res.get() == 0) {
+                    log(conn, "server dropped connection");
                     close(conn);
                     return;
                 }
-                if (!resp->can_write()) {
-                    conn->get_client_registration().update(conn->get_client_registration().get_state() ^ fd_state::OUT);
+                resp->skip_body((size_t) res.get());
+                conn->get_client_registration().update({fd_state::OUT, fd_state::RDHUP});
+            }
+            if (resp->is_read() || pipe->get_space() == 0) {
+                // Whole body is in pipe or client is too slow
+                conn->get_server_registration().update(fd_state::WAIT);
+            }
+        }
+    });
+
+    conn->get_client_registration().update(
+            {fd_state::OUT, fd_state::RDHUP}, [this, conn, rqst, resp, pipe](fd_state state) {
+        file_descriptor const &client = conn->get_client();
+        set_active(conn);
+
+        if (state.is(fd_state::RDHUP)) {
+            log(conn, "client dropped connection");
+            close(conn);
+            return;
+        }
+
+        if (state.is({fd_state::HUP, fd_state::ERROR})) {
+            int code;
+            socklen_t size = sizeof(code);
+            socket_wrap const &sock = *static_cast<socket_wrap const *>(&client);
+            sock.get_option(SO_ERROR, &code, &size);
+            annotated_exception exception(to_string(conn) + " splice", code);
+            log(exception);
+            close(conn);
+            return;
+        }
+
+        if (state.is(fd_state::OUT)) {
+            // Header and body that was read with it go first
+            io_result res = resp->can_write() ? resp->write_to(client) : pipe->splice_to(client);
+            if (res.is_error()) {
+                log(conn, res.get_exception("splice").what());
+                close(conn);
+                return;
+            }
+
+            if (!resp->can_write() && pipe->get_length() == 0) {
+                if (resp->is_written()) {
+                    log(conn, "body spliced");
+                    send_server_response(conn, rqst, resp);
+                    return;
                 }
+                // Wait for server
+                conn->get_client_registration().update(fd_state::RDHUP);
             }
-        });
+            if (!resp->is_read() && pipe->get_space() != 0) {
+                conn->get_server_registration().update({fd_state::IN, fd_state::RDHUP});
+            }
+        }
     });
 }
 
+std::shared_ptr<body_compressor> proxy_server::make_compressor(request_header const &request,
+                                                               response_header const &response) const {
+    // Chunked transfer coding of compressed body needs HTTP/1.1
+    if (!config.compression || request.get_request_line().get_type() != request_line::GET ||
+        request.get_request_line().get_http().compare("HTTP/1.1") != 0 ||
+        !body_compressor::is_compressible(response)) {
+        return nullptr;
+    }
+    std::string encoding = body_compressor::choose_encoding(request.get_property(header_name::ACCEPT_ENCODING));
+    if (encoding.empty()) {
+        return nullptr;
+    }
+    return std::make_shared<body_compressor>(encoding);
+}
+
+void proxy_server::add_encoding_vary(server_response &resp) const {
+    if (config.compression && body_compressor::is_compressible(resp.get_header())) {
+        // Clients that accept compression get compressed variant, not this one
+        response_header header = resp.get_header();
+        body_compressor::add_vary(header);
+        resp.set_header(header);
+    }
+}
 
-proxy_server::sockets_t::iterator proxy_server::save_registration(epoll_registration registration, size_t timeout) {
+void proxy_server::compress(connections_t::iterator conn, body_compressor &compressor, std::string const &body,
+                            bool finish, server_response &out) {
+    std::string compressed = compressor.feed(body, finish);
+    if (!compressed.empty()) {
+        out.read_from(make_chunk(compressed));
+    }
+    if (!finish) {
+        return;
+    }
+    out.read_from(make_chunk(""));
+
+    compressed_responses++;
+    compressed_input += compressor.get_input_length();
+    compressed_output += compressor.get_output_length();
+    compression_seconds += compressor.get_cpu_seconds();
+
+    double ns_per_byte = compressor.get_input_length() == 0 ? 0 :
+                         compressor.get_cpu_seconds() * 1e9 / compressor.get_input_length();
+    log(conn, "compressed " + std::to_string(compressor.get_input_length()) + " -> " +
+              std::to_string(compressor.get_output_length()) + " bytes, " + std::to_string(ns_per_byte) +
+              " ns/byte");
+    log("compression", std::to_string(compressed_responses) + " responses, " +
+                       std::to_string(compressed_input - compressed_output) + " bytes saved, " +
+                       std::to_string(compression_seconds * 1e9 / compressed_input) + " ns/byte");
+}
+
+
+proxy_server::sockets_t::iterator proxy_server::save_registration(epoll_registration registration, size_t timeout,
+                                                                  std::shared_ptr<arena> memory) {
     int fd = registration.get_fd().get();
-    return sockets.insert(std::make_pair(fd,
-                                         safe_registration(std::move(registration), timeout, ticks))).first;
+    return sockets.insert(std::make_pair(fd, safe_registration(std::move(registration), timeout, ticks,
+                                                               std::move(memory)))).first;
 }
 
 void proxy_server::change_timeout(sockets_t::iterator iterator,
@@ -633,6 +1884,7 @@ void proxy_server::set_active(sockets_t::iterator iterator) {
 }
 
 void proxy_server::close(sockets_t::iterator socket) {
+    release_zerocopy(socket->second.get_fd().get());
     sockets.erase(socket);
 }
 
@@ -654,6 +1906,7 @@ void proxy_server::change_timeout(connections_t::iterator iterator, size_t socke
 }
 
 void proxy_server::close(connections_t::iterator connection) {
+    release_zerocopy(connection->get_client().get());
     connections.erase(connection);
 }
 
@@ -661,33 +1914,154 @@ std::string to_string(proxy_server::connections_t::iterator const &iterator) {
     return to_string(*iterator);
 }
 
+std::shared_ptr<arena> const &proxy_server::memory_of(sockets_t::iterator iterator) {
+    return iterator->second.memory;
+}
+
+std::shared_ptr<arena> const &proxy_server::memory_of(connections_t::iterator iterator) {
+    return iterator->memory;
+}
+
 std::string proxy_server::to_url(request_header const &request) const {
-    std::string url = request.get_property("host");
-    url += request.get_request_line().get_url();
-    return url;
+    return keys.get_key(request);
+}
+
+std::string proxy_server::add_variant(request_header const &request, response_header const &response) {
+    std::string counted = keys.get_key(request);
+    std::string key = keys.add_variant(request, response);
+    if (key != counted) {
+        popularity.increment(key);
+    }
+    return key;
+}
+
+proxy_server::entry_ptr proxy_server::make_entry(cached_message response) const {
+    return std::make_shared<cache_entry>(std::move(response), config.stale_while_revalidate, config.stale_if_error,
+                                         time(nullptr));
+}
+
+proxy_server::entry_ptr proxy_server::make_entry(cached_message response, response_header const &header) const {
+    return std::make_shared<cache_entry>(std::move(response), header, config.stale_while_revalidate,
+                                         config.stale_if_error, time(nullptr));
+}
+
+void proxy_server::save_cached(std::string url, entry_ptr response) {
+    // Full memory cache takes only objects that are requested more often than the one they evict
+    bool admitted = cache.size() < MAX_CACHE_SIZE || cache.has(url) ||
+                    popularity.estimate(url) > popularity.estimate(cache.get_first());
+
+    if (disk.is_enabled()) {
+        try {
+            if (response->get_size() > MAX_MEMORY_OBJECT_SIZE || !admitted) {
+                cache.erase(url);
+                disk.insert(url, response->message);
+                return;
+            }
+            if (cache.size() == MAX_CACHE_SIZE && !cache.has(url)) {
+                // Spill evicted object to disk
+                std::pair<std::string, entry_ptr> evicted = cache.pop_first();
+                disk.insert(evicted.first, evicted.second->message);
+            }
+        } catch (annotated_exception const &e) {
+            log(e);
+        }
+    }
+    if (admitted) {
+        cache.insert(std::move(url), std::move(response));
+    }
+}
+
+void proxy_server::refresh_cached(request_header const &request, response_header const &not_modified,
+                                  entry_ptr cached) {
+    std::string url = to_url(request);
+    cache.erase(url);
+    save_cached(url, make_entry(merge_not_modified(cached->message, not_modified)));
+}
+
+void proxy_server::save_partial(std::string url, cached_message const &response) {
+    if (!sparse.has(url)) {
+        sparse.insert(url, sparse_entity());
+    }
+    if (!sparse.find(url).add(response)) {
+        // Entity was changed or response can't be used
+        sparse.erase(url);
+        sparse.insert(url, sparse_entity());
+        if (!sparse.find(url).add(response)) {
+            sparse.erase(url);
+            return;
+        }
+    }
+
+    if (sparse.find(url).is_complete()) {
+        log("cache", "parts of " + url + " are complete");
+        save_cached(url, make_entry(sparse.find(url).get_complete()));
+        sparse.erase(url);
+    }
 }
 
-void proxy_server::save_cached(std::string url, cached_message const &response) {
-    cache.insert(std::move(url), response);
+proxy_server::response_ptr proxy_server::select_ranges(request_header const &request,
+                                                     cache_entry const &cached) const {
+    response_header const &header = cached.header;
+    if (!request.has_property(header_name::RANGE) || header.get_request_line().get_code() != 200 ||
+        header.has_property(header_name::TRANSFER_ENCODING)) {
+        return to_response(cached);
+    }
+    if (request.has_property(header_name::IF_RANGE)) {
+        // Client has another version of entity, so it gets the whole one
+        std::string validator = request.get_property(header_name::IF_RANGE);
+        bool is_etag = !validator.empty() && validator[0] == '"';
+        if (validator.compare(is_etag ? cached.etag : cached.last_modified) != 0) {
+            return to_response(cached);
+        }
+    }
+
+    // Parts are sliced from cached entry, so only the selected bytes are copied
+    size_t body = find_body(cached.message);
+    if (body == std::string::npos) {
+        return to_response(cached);
+    }
+    std::vector<byte_range> ranges;
+    if (!parse_ranges(request.get_property(header_name::RANGE), cached.get_size() - body, ranges)) {
+        return to_response(cached);
+    }
+    return std::make_shared<server_response>(slice_ranges(cached.message, ranges));
 }
 
-bool proxy_server::is_cached(request_header const &request) const {
-    return cache.has(to_url(request));
+freshness proxy_server::get_freshness(cache_entry const &cached) const {
+    return cached.fresh.at(time(nullptr));
 }
 
-cached_message proxy_server::get_cached(request_header const &request) const {
-    return cache.find(to_url(request));
+proxy_server::response_ptr proxy_server::to_response(cache_entry const &cached) const {
+    return std::make_shared<server_response>(cached.message, cached.header);
+}
+
+proxy_server::entry_ptr proxy_server::get_cached(request_header const &request) const {
+    std::string url = to_url(request);
+    if (cache.has(url)) {
+        return cache.find(url);
+    }
+    if (disk.has(url)) {
+        return make_entry(disk.find(url));
+    }
+    return nullptr;
 }
 
 void proxy_server::delete_cached(request_header const &request) {
-    cache.erase(to_url(request));
+    std::string url = to_url(request);
+    cache.erase(url);
+    try {
+        disk.erase(url);
+    } catch (annotated_exception const &e) {
+        log(e);
+    }
 }
 
 bool proxy_server::should_cache(response_header const &header) const {
-    if (header.has_property("cache-control")) {
-        std::string value = to_lower(header.get_property("cache_control"));
+    if (header.has_property(header_name::CACHE_CONTROL)) {
+        std::string value = to_lower(header.get_property(header_name::CACHE_CONTROL));
         if (value.find("no-cache") != std::string::npos ||
             value.find("no-store") != std::string::npos ||
+            value.find("private") != std::string::npos ||
             value.find("must-revalidate") != std::string::npos ||
             value.find("proxy-revalidate") != std::string::npos ||
             value.find("max-age=0") != std::string::npos) {
@@ -695,8 +2069,8 @@ bool proxy_server::should_cache(response_header const &header) const {
         }
     }
 
-    if (header.has_property("pragma")) {
-        std::string value = to_lower(header.get_property("pragma"));
+    if (header.has_property(header_name::PRAGMA)) {
+        std::string value = to_lower(header.get_property(header_name::PRAGMA));
         if (value.find("no-cache") != std::string::npos) {
             return false;
         }
@@ -707,31 +2081,37 @@ bool proxy_server::should_cache(response_header const &header) const {
         return false;
     }
 
-    if (!header.has_property("etag") && !header.has_property("last-modified")) {
+    if (header.get_property(header_name::VARY).find('*') != std::string::npos) {
+        return false;       // Varies on things outside of request
+    }
+
+    if (!header.has_property(header_name::ETAG) && !header.has_property(header_name::LAST_MODIFIED)) {
         return false;       // Otherwise can't validate
     }
 
     return true;
 }
 
-client_request proxy_server::make_validate_request(request_header rqst, response_header response) const {
+proxy_server::request_ptr proxy_server::make_validate_request(request_header const &rqst,
+                                                             cache_entry const &cached) const {
     request_header header(rqst.get_request_line());
-    header.set_property("host", rqst.get_property("host"));
-    if (response.has_property("etag")) {
-        header.set_property("if-none-match", response.get_property("etag"));
+    header.set_property(header_name::HOST, rqst.get_property(header_name::HOST));
+    if (!cached.etag.empty()) {
+        header.set_property(header_name::IF_NONE_MATCH, cached.etag);
     }
-    if (response.has_property("last-modified")) {
-        header.set_property("if-modified-since", response.get_property("last-modified"));
+    if (!cached.last_modified.empty()) {
+        header.set_property(header_name::IF_MODIFIED_SINCE, cached.last_modified);
     }
-    header.set_property("connection", rqst.get_property("connection"));
-    return client_request(header, "");
+    header.set_property(header_name::CONNECTION, rqst.get_property(header_name::CONNECTION));
+    return std::make_shared<client_request>(header, "");
 }
 
-proxy_server::connection::connection() : timeout(0), expires_in(0) { }
+proxy_server::connection::connection() : timeout(0), expires_in(0), parent(upstream_pool::NONE) { }
 
 proxy_server::connection::connection(epoll_registration &&client, epoll_registration &&server, size_t timeout,
-                                     size_t ticks) :
-        timeout(timeout), expires_in(ticks + timeout), client(std::move(client)), server(std::move(server)) { }
+                                     size_t ticks, std::shared_ptr<arena> memory) :
+        timeout(timeout), expires_in(ticks + timeout), memory(std::move(memory)), parent(upstream_pool::NONE),
+        client(std::move(client)), server(std::move(server)) { }
 
 socket_wrap const &proxy_server::connection::get_client() const {
     return *static_cast<socket_wrap const *>(&client.get_fd());
@@ -755,6 +2135,12 @@ void swap(proxy_server::connection &first, proxy_server::connection &second) {
     swap(first.server, second.server);
     swap(first.timeout, second.timeout);
     swap(first.expires_in, second.expires_in);
+    swap(first.memory, second.memory);
+    swap(first.spare, second.spare);
+    swap(first.upstream, second.upstream);
+    swap(first.parent, second.parent);
+    swap(first.load, second.load);
+    swap(first.sent, second.sent);
 }
 
 std::string to_string(proxy_server::connection const &conn) {
@@ -769,8 +2155,10 @@ std::string to_string(proxy_server::connection const &conn) {
 proxy_server::safe_registration::safe_registration() : epoll_registration(), timeout(0), expires_in(0) {
 }
 
-proxy_server::safe_registration::safe_registration(epoll_registration &&registration, size_t timeout, size_t ticks) :
-        epoll_registration(std::move(registration)), timeout(timeout), expires_in(ticks + timeout) {
+proxy_server::safe_registration::safe_registration(epoll_registration &&registration, size_t timeout, size_t ticks,
+                                                   std::shared_ptr<arena> memory) :
+        epoll_registration(std::move(registration)), timeout(timeout), expires_in(ticks + timeout),
+        memory(std::move(memory)) {
 }
 
 proxy_server::safe_registration::safe_registration(proxy_server::safe_registration &&other) : safe_registration() {
@@ -788,6 +2176,7 @@ void swap(proxy_server::safe_registration &first, proxy_server::safe_registratio
     swap(*static_cast<epoll_registration *>(&first), *static_cast<epoll_registration *>(&second));
     swap(first.timeout, second.timeout);
     swap(first.expires_in, second.expires_in);
+    swap(first.memory, second.memory);
 }
 
 
@@ -13,10 +13,26 @@
 #include <memory>
 #include <map>
 #include <list>
+#include <vector>
+#include <deque>
+#include <chrono>
 
 #include "resolver.h"
 #include "../util/wraps.h"
 #include "../util/buffered_message.h"
+#include "../util/disk_cache.h"
+#include "../util/cache_key.h"
+#include "../util/frequency_sketch.h"
+#include "../util/freshness.h"
+#include "../util/cache_entry.h"
+#include "../util/byte_range.h"
+#include "../util/compressor.h"
+#include "../util/arena.h"
+#include "../util/zerocopy.h"
+#include "../util/peer_message.h"
+#include "../util/hash_ring.h"
+#include "../util/upstream_pool.h"
+#include "snapshot_loader.h"
 
 // Proxy server. It starts, when epoll it contains is started, and stops in destructor
 struct proxy_server {
@@ -25,20 +41,67 @@ struct proxy_server {
         std::string host;
     };
 
+    // Runtime settings of proxy_server
+    struct settings {
+        uint16_t port;
+        int queue_size;             // Backlog of listening socket, -1 means SOMAXCONN
+        size_t accept_budget;       // Maximal number of clients accepted on one wakeup
+        std::string cache_directory;    // Directory of disk cache, empty if disk cache is disabled
+        size_t disk_cache_size;         // Maximal size of disk cache in bytes
+        std::string snapshot_file;      // File for saving cache between runs, empty if it isn't saved
+        bool sort_query;                // Treat URLs that differ only in order of query parameters as same
+        long stale_while_revalidate;    // Defaults of Cache-Control extensions for responses without them,
+        long stale_if_error;            // in seconds
+        bool compression;               // Compress text responses for clients that accept it
+        size_t splice_threshold;        // Uncached bodies at least this long are spliced, 0 disables splicing
+        size_t zerocopy_threshold;      // Cached responses at least this long are sent with MSG_ZEROCOPY,
+                                        // 0 disables it
+        // Sibling proxy that is asked about responses missing in cache before their origin servers
+        struct peer {
+            endpoint http;              // Where peer takes proxy requests
+            endpoint query;             // Where peer answers queries
+        };
+        uint16_t peer_port;             // UDP port for queries of peers, 0 if peers can't ask this proxy
+        std::vector<peer> peers;
+        long peer_timeout;              // Milliseconds to wait for answers of peers
+        // Cluster that shares one cache: each cacheable request is forwarded to member that owns its key.
+        // It includes this proxy, that is found by <self> or, if <self> isn't set, by port that only it has
+        std::vector<endpoint> members;
+        endpoint self;
+        // Parent proxy that requests to servers go through
+        struct parent {
+            endpoint address;
+            unsigned weight;
+        };
+        std::vector<parent> parents;    // Servers are connected directly if it's empty
+        long parent_check;              // Seconds between active health checks of parents, 0 disables them
+
+        settings();
+        settings(uint16_t port, int queue_size);
+    };
+
     proxy_server() = delete;
 
     // Creates proxy_server that uses <epoll> for polling, <resolver> for resolving IPs and
     // can listen <queue_size> connections to <port>
     proxy_server(epoll_wrap &epoll, resolver<resolver_extra> &resolver, uint16_t port, int queue_size);
+    proxy_server(epoll_wrap &epoll, resolver<resolver_extra> &resolver, settings const &config);
+
+    // Save memory cache to snapshot file, so next run starts with warm cache
+    void save_snapshot() const;
 
 private:
     static const size_t MAX_CACHE_SIZE = 20000;
+    static const size_t MAX_MEMORY_OBJECT_SIZE = 1024 * 1024;      // Bigger objects are cached only on disk
+    static const size_t MAX_SPARSE_ENTITIES = 64;
+    // Block of client's arena fits one message with its header fields
+    static const size_t ARENA_BLOCK_SIZE = sizeof(buffered_message<response_header>) + 1024;
 
     // Connection between two epoll_registrations (with timeout)
     struct connection {
         connection();
         connection(epoll_registration &&client, epoll_registration &&server,
-                   size_t timeout, size_t ticks);
+                   size_t timeout, size_t ticks, std::shared_ptr<arena> memory);
         connection(connection &&other) = default;
         connection &operator=(connection &&other) = default;
 
@@ -51,6 +114,12 @@ private:
         friend void swap(connection &first, connection &second);
 
         size_t timeout, expires_in;
+        std::shared_ptr<arena> memory;      // Memory of client's requests
+        std::shared_ptr<arena> spare;       // Memory of previous keep-alive cycle
+        std::string upstream;               // Peer that server socket leads to, empty for origin server
+        size_t parent;                      // Parent proxy that server socket leads to, NONE for server
+        load_lease load;                    // Load of upstream that handles request
+        std::chrono::steady_clock::time_point sent;     // When request was sent to parent
     private:
         epoll_registration client, server;
     };
@@ -63,9 +132,11 @@ private:
     struct safe_registration : epoll_registration {
         size_t timeout;
         size_t expires_in;
+        std::shared_ptr<arena> memory;      // Memory of client's requests, null for other sockets
 
         safe_registration();
-        safe_registration(epoll_registration &&registration, size_t timeout, size_t cur_ticks);
+        safe_registration(epoll_registration &&registration, size_t timeout, size_t cur_ticks,
+                          std::shared_ptr<arena> memory);
         safe_registration(safe_registration &&other);
         safe_registration &operator=(safe_registration &&other);
 
@@ -76,70 +147,201 @@ private:
     friend std::string to_string(safe_registration const &reg);
 
     // Types of used containers
-    using cache_t = simple_cache<std::string, cached_message, MAX_CACHE_SIZE>;
+    using entry_ptr = std::shared_ptr<cache_entry const>;
+    using cache_t = simple_cache<std::string, entry_ptr, MAX_CACHE_SIZE>;
+    using sparse_cache_t = simple_cache<std::string, sparse_entity, MAX_SPARSE_ENTITIES>;
     using sockets_t = std::map<int, safe_registration>;
     using connections_t = std::list<connection>;
     using resolver_t = resolver<resolver_extra>;
     using resolved_ip_t = resolved_ip<resolver_extra>;
 
-    // Actions used in connections handling
+    // Messages are shared between steps of handling instead of being copied
+    using request_ptr = std::shared_ptr<client_request>;
+    using response_ptr = std::shared_ptr<server_response>;
+
+    // Actions used in connections handling. Small actions don't allocate memory
     template<typename... Args>
-    using action_with = std::function<void(Args...)>;
+    using action_with = event_handler<void(Args...), 64>;
 
     using action = action_with<>;
     using action_with_connection = action_with<typename connections_t::iterator>;
-    using action_with_response = action_with<server_response>;
-    using action_with_request = action_with<client_request>;
+    using action_with_response = action_with<response_ptr>;
+    using action_with_request = action_with<request_ptr>;
+
+    // Request that waits for connection to its server
+    struct pending_request {
+        request_ptr rqst;
+        action_with_connection next;
+        action_with<sockets_t::iterator> on_fail;       // Send stale cached or 404 if it's empty
+    };
+
+    using on_resolve_t = std::map<std::pair<int, std::string>, pending_request>;
+
+    // Request that waits for answers of peers
+    struct peer_query {
+        sockets_t::iterator client;
+        request_ptr rqst;
+        std::string key;
+        size_t answers_left;
+        std::chrono::steady_clock::time_point deadline;
+    };
 
-    using on_resolve_t = std::map<std::pair<int, std::string>,
-            action_with_connection>;
+    using peer_queries_t = std::map<uint32_t, peer_query>;
 
     // Default timeouts
     static const size_t TICK_INTERVAL = 2;
     static const size_t SHORT_SOCKET_TIMEOUT = 60 * 2;
     static const size_t LONG_SOCKET_TIMEOUT = 60 * 10;
     static const size_t INFINITE_TIMEOUT = (size_t) 1 << (4 * sizeof(size_t));
+    // Token of Via header of requests forwarded inside cluster, such requests aren't forwarded again
+    static const std::string CLUSTER_VIA;
+    // Maximal number of peer messages handled on one wakeup
+    static const size_t PEER_BUDGET = 64;
 
-    // Monadic-like functions for handling connections
-    // Connect to server and do "next"
-    void connect_to_server(sockets_t::iterator sock, std::string host, action_with_connection next);
+    // Flow control of fast transfer. Reading from server (or from client during upload) is paused when
+    // the other side has more than HIGH_WATERMARK unsent bytes and resumed when it has less than LOW_WATERMARK
+    static const size_t HIGH_WATERMARK = 4 * server_response::BUFFER_LENGTH;
+    static const size_t LOW_WATERMARK = server_response::BUFFER_LENGTH;
 
-    // Read message and do "next"
+    // Monadic-like functions for handling connections
+    // Connect to server of request and do "next"
+    void connect_to_server(sockets_t::iterator sock, request_ptr rqst, action_with_connection next);
+    // Connect to <address> instead of server of request. If connecting fails, do "on_fail"
+    void connect_to_endpoint(sockets_t::iterator sock, request_ptr rqst, endpoint address,
+                             action_with_connection next, action_with<sockets_t::iterator> on_fail);
+    // Wait for connection of socket to server of request
+    void wait_for_server(sockets_t::iterator sock, request_ptr rqst, action_with_connection next,
+                         action_with<sockets_t::iterator> on_fail);
+    // Connect socket of pending request to resolved IP
+    void connect_to_ip(resolved_ip_t ip);
+    // Connecting failed, do "on_fail" of pending request
+    void fail_connecting(on_resolve_t::iterator pending, sockets_t::iterator client);
+
+    // Read message and do "next". If reading fails, do "on_error" or close iterator if it's empty
     template<typename T, typename C>
-    void read(epoll_registration &from, buffered_message<T> message, C iterator, action_with<buffered_message<T>> next);
+    void read(epoll_registration &from, std::shared_ptr<buffered_message<T>> message, C iterator,
+              action_with<std::shared_ptr<buffered_message<T>>> next, action on_error = nullptr);
 
-    // Send message and do "next"
+    // Send message and do "next". If sending fails, do "on_error" or close iterator if it's empty
     template<typename T, typename C>
-    void send(epoll_registration &to, buffered_message<T> message, C iterator, action next);
+    void send(epoll_registration &to, std::shared_ptr<buffered_message<T>> message, C iterator, action next,
+              action on_error = nullptr);
+
+    // Handle failed reading or sending
+    template<typename C>
+    void fail(C iterator, action const &on_error);
 
     // Send request, read response and do "next"
     template<typename C>
-    void send_and_read(epoll_registration &to, client_request, C iterator, action_with_response next);
+    void send_and_read(epoll_registration &to, request_ptr rqst, C iterator, action_with_response next,
+                       action on_error = nullptr);
+
+    // Request can be handled as soon as its header is read, its body is streamed to server after connecting.
+    // Response is handled when it's read whole
+    static bool is_ready(client_request const &rqst);
+    static bool is_ready(server_response const &resp);
+
+    // Send request to server and do "next". Body that isn't read yet is streamed from client
+    void send_request(connections_t::iterator conn, request_ptr rqst, action next);
+    void stream_request(connections_t::iterator conn, request_ptr rqst, action next);
 
     // Read response and send it to client during reading
-    void fast_transfer(connections_t::iterator conn, client_request rqst);
+    void fast_transfer(connections_t::iterator conn, request_ptr rqst);
+    // Handler that sends response to client while it's read
+    epoll_wrap::handler_t make_response_writer(connections_t::iterator conn, response_ptr resp);
+    // Send what is read of response, then move rest of its body from server to client through <pipe>
+    // and finish response as usual
+    void splice_body(connections_t::iterator conn, request_ptr rqst, response_ptr resp,
+                     std::shared_ptr<pipe_wrap> pipe);
+
+    // Compressor for response to request, null if response should be sent as is
+    std::shared_ptr<body_compressor> make_compressor(request_header const &request,
+                                                     response_header const &response) const;
+    // Response that is sent as is while proxy can compress it varies by Accept-Encoding, <resp> isn't written yet
+    void add_encoding_vary(server_response &resp) const;
+    // Compress next part of body and add it to <out> as chunk
+    void compress(connections_t::iterator conn, body_compressor &compressor, std::string const &body, bool finish,
+                  server_response &out);
 
     // Send response and save to cache if it's possible
-    void send_server_response(connections_t::iterator conn, client_request rqst, server_response);
+    void send_server_response(connections_t::iterator conn, request_ptr rqst, response_ptr resp);
+
+    // Send fresh cached response to request: 304 if it's conditional, header if it's HEAD, whole otherwise
+    void send_fresh(connections_t::iterator conn, request_ptr rqst, entry_ptr cached);
+    // Send cached response (or its ranges) to client. Big responses are sent without copying
+    void send_cached(connections_t::iterator conn, request_ptr rqst, entry_ptr cached);
+    bool can_send_zerocopy(request_header const &request, cache_entry const &cached) const;
+    template<typename C>
+    void send_zerocopy(epoll_registration &to, C iterator, entry_ptr cached, action next);
+    // Forget zero-copy sends of socket that is closed. Buffers they use are kept for a while
+    void release_zerocopy(int fd);
 
     // Send 404 bad request
     void send_404(sockets_t::iterator client);
 
+    // Server of request failed. Send stale cached response if it's allowed, 404 otherwise
+    void send_stale_or_404(sockets_t::iterator client, request_ptr rqst);
+
+    // Send stale cached response and validate it after that
+    void revalidate_in_background(connections_t::iterator conn, request_ptr rqst, entry_ptr cached);
+
     // Get client from broken connection
     sockets_t::iterator escape_client(connections_t::iterator conn);
 
+    // Answer request from cache before connecting to server: fresh response, or 504 if only cached one is asked.
+    // False if server is needed (response isn't cached or should be validated)
+    bool send_from_cache(sockets_t::iterator client, request_ptr rqst);
+    // Read next request of client that isn't connected to server
+    void read_next_request(sockets_t::iterator client, request_ptr previous);
+
+    // Peers
+    // Connect to server of request. Responses that aren't cached are asked from peers first
+    void start_request(sockets_t::iterator client, request_ptr rqst);
+    bool should_ask_peers(client_request const &rqst) const;
+    static bool is_only_if_cached(request_header const &request);
+    void ask_peers(sockets_t::iterator client, request_ptr rqst);
+    // Answer query of peer or take answer to own query
+    void handle_peer_message(peer_message const &message, endpoint const &from);
+    // Stop waiting for answers, fetch response from <peer> or from origin server if it's null
+    void finish_query(peer_queries_t::iterator query, settings::peer const *peer);
+    // Timer fires at the nearest deadline of queries
+    void arm_peer_timer();
+    // Fetch response that peer has. If peer fails, origin server is asked
+    action_with_connection fetch_from_peer(request_ptr rqst, std::string peer);
+    void fetch_from_origin(connections_t::iterator conn, request_ptr rqst);
+
+    // Cluster
+    // Member of cluster that request should be forwarded to, false if this proxy handles it
+    bool should_forward(client_request const &rqst, size_t &member) const;
+    void forward_to_member(sockets_t::iterator client, request_ptr rqst, size_t member);
+
+    // Parent proxies
+    // Connect to parent picked for request. If connecting fails, other parents are tried <attempts> times
+    void connect_to_parent(sockets_t::iterator sock, request_ptr rqst, action_with_connection next,
+                           size_t attempts);
+    // Request that is sent to parent takes load of parent and is written with absolute URL.
+    // Nothing is done for other upstreams
+    void prepare_parent_request(connections_t::iterator conn, request_ptr rqst);
+    // Ask parent to open tunnel for CONNECT, then tunnel as usual
+    void tunnel_through_parent(connections_t::iterator conn, request_ptr rqst);
+    // Active health check, connecting to each parent
+    void check_parents();
+    static double elapsed_ms(std::chrono::steady_clock::time_point since);
+
     // Default actions
     // Connect to host from header
     action_with_request first_request_read(sockets_t::iterator client);
-    // If host differs from host, then connect. Otherwise, handle request
-    action reuse_connection(connections_t::iterator conn, std::string old_host);
+    // Read next request (or take already read pipelined one). If its host differs from host of <previous>,
+    // then connect. Otherwise, handle request
+    action reuse_connection(connections_t::iterator conn, request_ptr previous);
     // Start validation or start transfer
-    action_with_connection handle_client_request(client_request rqst);
+    action_with_connection handle_client_request(request_ptr rqst);
     // Start raw transfer
-    action handle_connect(connections_t::iterator conn);
+    // <from_server> is data of tunnel that was read with response of parent
+    action handle_connect(connections_t::iterator conn, std::string from_server = std::string());
     // Decide, can we send cached or should download response again
-    action_with_response handle_validation_response(connections_t::iterator conn, client_request rqst,
-                                                    server_response cached);
+    action_with_response handle_validation_response(connections_t::iterator conn, request_ptr rqst,
+                                                    entry_ptr cached);
     // Connect to server
     epoll_wrap::handler_t make_server_connect_handler(connections_t::iterator conn, resolved_ip_t ip);
     epoll_wrap::handler_t make_connect_transfer_handler(epoll_registration &in,
@@ -148,7 +350,8 @@ private:
                                                         std::shared_ptr<raw_message> out_message,
                                                         connections_t::iterator conn);
     // Keeping active sockets and connections
-    sockets_t::iterator save_registration(epoll_registration registration, size_t socket_timeout);
+    sockets_t::iterator save_registration(epoll_registration registration, size_t socket_timeout,
+                                          std::shared_ptr<arena> memory = nullptr);
     void close(sockets_t::iterator socket);
     void change_timeout(sockets_t::iterator, size_t socket_timeout);
     void set_active(sockets_t::iterator iterator);
@@ -160,14 +363,34 @@ private:
     void set_active(connections_t::iterator iterator);
     friend std::string to_string(connections_t::iterator const &iterator);
 
+    // Memory for messages of client
+    static std::shared_ptr<arena> const &memory_of(sockets_t::iterator iterator);
+    static std::shared_ptr<arena> const &memory_of(connections_t::iterator iterator);
+
     // Caching
     bool should_cache(response_header const &header) const;
-    client_request make_validate_request(request_header rqst, response_header response) const;
+    request_ptr make_validate_request(request_header const &rqst, cache_entry const &cached) const;
+    // Key of cached response to request
     std::string to_url(request_header const &request) const;
-    void save_cached(std::string url, cached_message const &response);
-    bool is_cached(request_header const &request) const;
-    cached_message get_cached(request_header const &request) const;
+    // Remember Vary of response and return key to save it with. Request counted in popularity before Vary was known
+    // is counted for key of the variant too, so admission estimates the key that was incremented
+    std::string add_variant(request_header const &request, response_header const &response);
+    entry_ptr make_entry(cached_message response) const;
+    entry_ptr make_entry(cached_message response, response_header const &header) const;
+    void save_cached(std::string url, entry_ptr response);
+    // Cached response, it's parsed only if it's taken from disk
+    entry_ptr get_cached(request_header const &request) const;
     void delete_cached(request_header const &request);
+    void refresh_cached(request_header const &request, response_header const &not_modified,
+                        entry_ptr cached);
+    freshness get_freshness(cache_entry const &cached) const;
+    // Response that is sent from cache
+    response_ptr to_response(cache_entry const &cached) const;
+    // Save part of entity from 206 response. Entity is cached when all its parts are received
+    void save_partial(std::string url, cached_message const &response);
+    // Cached response or its parts requested by Range
+    response_ptr select_ranges(request_header const &request, cache_entry const &cached) const;
+    void start_snapshot_loading();
 
     epoll_wrap &epoll;
     resolver_t &rt;
@@ -177,10 +400,42 @@ private:
     connections_t connections;      // Active connections
     sockets_t sockets;              // Active sockets
     cache_t cache;                  // Cache
+    disk_cache disk;                // Second tier of cache, keeps evicted and big objects
+    cache_key_builder keys;         // Keys of cache
+    frequency_sketch popularity;    // Frequencies of requested keys, used for admission to cache
+    sparse_cache_t sparse;          // Entities that are partially received
+
+    std::map<int, zerocopy_tracker> zerocopy;       // Zero-copy sends of client sockets
+    // Buffers of zero-copy sends to closed sockets with ticks when they are released
+    std::deque<std::pair<size_t, zerocopy_tracker::pin_t>> zerocopy_orphans;
+
+    // Statistics of compression
+    size_t compressed_responses;
+    size_t compressed_input, compressed_output;
+    double compression_seconds;
+
+    settings config;
 
     sockets_t::iterator listener;
     sockets_t::iterator notifier;
     sockets_t::iterator timer;
+
+    // Valid only if peers are configured or peer port is set
+    sockets_t::iterator peer_socket;            // UDP socket for queries and answers
+    sockets_t::iterator peer_timer;
+    peer_queries_t peer_queries;                // Own queries that wait for answers
+    uint32_t next_query_id;
+
+    hash_ring cluster;                          // Members of cluster, empty if proxy isn't in cluster
+    size_t self_member;                         // This proxy in cluster, size of cluster if it isn't there
+
+    upstream_pool parents;                      // Parent proxies, empty if servers are connected directly
+    std::map<size_t, sockets_t::iterator> parent_checks;       // Health checks that aren't finished
+    std::chrono::steady_clock::time_point next_parent_check;
+
+    std::unique_ptr<snapshot_loader> loader;                    // Not null while snapshot is loading
+    sockets_t::iterator loader_notifier;
+    std::chrono::steady_clock::time_point loading_start;
 };
 
 
@@ -0,0 +1,60 @@
+#include "snapshot_loader.h"
+
+snapshot_loader::snapshot_loader(std::string const &path, file_descriptor const &notifier) :
+        notifier(notifier), mutex(), loaded(), finished(false), should_stop(false),
+        thread(&snapshot_loader::main_loop, this, path) {
+}
+
+snapshot_loader::~snapshot_loader() {
+    should_stop = true;
+}
+
+snapshot_loader::entries_t snapshot_loader::get_loaded() {
+    entries_t res;
+    {
+        std::lock_guard<std::mutex> lg(mutex);
+        res.swap(loaded);
+    }
+    return res;
+}
+
+bool snapshot_loader::is_finished() const {
+    return finished;
+}
+
+void snapshot_loader::main_loop(std::string path) {
+    entries_t batch;
+    try {
+        snapshot_reader reader(path);
+        entry_t entry;
+        while (!should_stop && reader.next(entry.first, entry.second)) {
+            batch.push_back(std::move(entry));
+            if (batch.size() == BATCH_SIZE) {
+                flush(batch);
+            }
+        }
+    } catch (annotated_exception const &e) {
+        log(e);
+    }
+    flush(batch);
+    finished = true;
+
+    uint64_t u = 1;
+    notifier.write(&u, sizeof(uint64_t));
+}
+
+void snapshot_loader::flush(entries_t &batch) {
+    if (batch.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lg(mutex);
+        for (auto it = batch.begin(); it != batch.end(); it++) {
+            loaded.push_back(std::move(*it));
+        }
+    }
+    batch.clear();
+
+    uint64_t u = 1;
+    notifier.write(&u, sizeof(uint64_t));
+}
@@ -0,0 +1,52 @@
+/*
+ * snapshot_loader.h
+ *
+ * Background loading of cache snapshot
+ */
+
+#ifndef SNAPSHOT_LOADER_H_
+#define SNAPSHOT_LOADER_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include "resolver.h"
+#include "../util/wraps.h"
+#include "../util/cache_snapshot.h"
+
+// Loads snapshot of cache in background thread. Loaded entries are passed in batches,
+// <notifier> is written to after every batch and after the end of loading
+struct snapshot_loader {
+    using entry_t = std::pair<std::string, cached_message>;
+    using entries_t = std::vector<entry_t>;
+
+    snapshot_loader(std::string const &path, file_descriptor const &notifier);
+
+    snapshot_loader(snapshot_loader const &other) = delete;
+    snapshot_loader &operator=(snapshot_loader const &other) = delete;
+
+    // Stops loading
+    ~snapshot_loader();
+
+    // Take entries loaded since the last call
+    entries_t get_loaded();
+
+    // Are all entries already passed to get_loaded()
+    bool is_finished() const;
+
+private:
+    static const size_t BATCH_SIZE = 256;
+
+    void main_loop(std::string path);
+    void flush(entries_t &batch);
+
+    file_descriptor const &notifier;
+    std::mutex mutex;
+    entries_t loaded;
+    std::atomic_bool finished, should_stop;
+    thread_wrap thread;     // Should be the last, because it uses other fields
+};
+
+#endif /* SNAPSHOT_LOADER_H_ */
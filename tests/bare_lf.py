@@ -0,0 +1,51 @@
+"""
+Messages with bare LF line endings are split right after their empty line: pipelined requests
+of one connection and responses with body reach the other side whole
+"""
+
+import re
+import sys
+
+from harness import check, proxy, server
+
+BODIES = {"/one": b"first", "/two": b"second"}
+
+
+def read_until(sock, pattern, data):
+    """Reads until pattern matches data, returns match, read data is match.string"""
+    while True:
+        match = re.search(pattern, data, re.S)
+        if match:
+            return match
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise EOFError("connection closed, got %r" % data)
+        data += chunk
+
+
+def origin(sock):
+    data = b""
+    while True:
+        match = read_until(sock, rb"^[A-Z]+ (\S+) .*?\n\r?\n", data)
+        data = match.string[match.end():]
+        body = BODIES.get(match.group(1).decode(), b"missing")
+        sock.sendall(b"HTTP/1.1 200 OK\nContent-Length: %d\n\n%s" % (len(body), body))
+
+
+upstream = server(origin)
+host = "127.0.0.1:%d" % upstream.port
+with proxy(sys.argv[1]) as p:
+    client = p.connect()
+    client.sendall(("GET http://%s/one HTTP/1.1\nHost: %s\n\n"
+                    "GET http://%s/two HTTP/1.1\nHost: %s\n\n" % (host, host, host, host)).encode())
+    data = b""
+    for path in ("/one", "/two"):
+        match = read_until(client, rb"^(HTTP/1\.1 200.*?\n)\r?\n", data)
+        data = match.string[match.end():]
+        length = int(re.search(rb"(?i)content-length: *(\d+)", match.group(1)).group(1))
+        while len(data) < length:
+            chunk = client.recv(65536)
+            check(chunk, "connection closed before body of %s, got %r" % (path, data))
+            data += chunk
+        check(data[:length] == BODIES[path], "body of %s is damaged: %r" % (path, data[:length]))
+        data = data[length:]
@@ -0,0 +1,40 @@
+"""
+Fresh cached response answers GET, HEAD and conditional requests without connecting to server,
+so they work while server is down. Requests of one keep-alive connection are answered in order
+"""
+
+import sys
+from email.utils import formatdate
+
+from harness import check, proxy, read_header, read_response, server
+
+
+def origin(sock):
+    read_header(sock)
+    sock.sendall(("HTTP/1.1 200 OK\r\nDate: %s\r\nCache-Control: max-age=600\r\nETag: \"v1\"\r\n"
+                  "Content-Length: 5\r\nConnection: close\r\n\r\nhello" % formatdate(usegmt=True)).encode())
+
+
+upstream = server(origin)
+url = "http://127.0.0.1:%d/page" % upstream.port
+host = "127.0.0.1:%d" % upstream.port
+with proxy(sys.argv[1]) as p:
+    client = p.connect()
+    client.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (url, host)).encode())
+    header, body, _ = read_response(client)
+    check(body == b"hello", "first response isn't forwarded: %r" % body)
+    client.close()
+
+    upstream.stop()
+
+    client = p.connect()
+    client.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\nIf-None-Match: \"v1\"\r\n\r\n"
+                    "HEAD %s HTTP/1.1\r\nHost: %s\r\n\r\n"
+                    "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (url, host, url, host, url, host)).encode())
+    header, rest = read_header(client)
+    check(header.startswith("HTTP/1.1 304"), "conditional request isn't answered with 304: " + header)
+    header, rest = read_header(client, rest)
+    check(header.startswith("HTTP/1.1 200"), "HEAD isn't answered: " + header)
+    check("content-length: 5" in header.lower(), "HEAD answer has no length of body: " + header)
+    header, body, _ = read_response(client, rest)
+    check(header.startswith("HTTP/1.1 200") and body == b"hello", "GET isn't answered: %s %r" % (header, body))
@@ -0,0 +1,36 @@
+"""
+Response that proxy could compress, but sends as is to client without Accept-Encoding, has
+Vary: Accept-Encoding both when it's forwarded and when it's sent from cache
+"""
+
+import sys
+from email.utils import formatdate
+
+from harness import check, proxy, read_header, read_response, server
+
+BODY = b"text that is long enough to be compressed " * 20
+requests = []
+
+
+def origin(sock):
+    data = b""
+    while True:
+        header, data = read_header(sock, data)
+        requests.append(header.split("\r\n")[0])
+        sock.sendall(("HTTP/1.1 200 OK\r\nDate: %s\r\nCache-Control: max-age=600\r\nETag: \"1\"\r\n"
+                      "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n"
+                      % (formatdate(usegmt=True), len(BODY))).encode() + BODY)
+
+
+upstream = server(origin)
+url = "http://127.0.0.1:%d/text" % upstream.port
+host = "127.0.0.1:%d" % upstream.port
+with proxy(sys.argv[1], "--compress=1") as p:
+    for source in ("server", "cache"):
+        client = p.connect()
+        client.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\n\r\n" % (url, host)).encode())
+        header, body, _ = read_response(client)
+        client.close()
+        check(body == BODY, "body from %s is changed: %r" % (source, body))
+        check("vary: accept-encoding" in header.lower(), "response from %s has no Vary: %s" % (source, header))
+    check(len(requests) == 1, "response isn't cached: %r" % requests)
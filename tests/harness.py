@@ -0,0 +1,129 @@
+"""
+Helpers for end-to-end tests: proxy_server is started against small servers that run in the test process
+"""
+
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+
+def fail(message):
+    print("FAIL: " + message)
+    sys.exit(1)
+
+
+def check(condition, message):
+    if not condition:
+        fail(message)
+
+
+def free_port():
+    sock = socket.socket()
+    sock.bind(("127.0.0.1", 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def wait_for(port):
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    fail("nothing listens on port %d" % port)
+
+
+class proxy:
+    """proxy_server on a free port, stopped when the test leaves 'with' block"""
+
+    def __init__(self, binary, *args):
+        self.port = free_port()
+        self.process = subprocess.Popen([binary, str(self.port)] + list(args),
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        wait_for(self.port)
+
+    def connect(self):
+        sock = socket.create_connection(("127.0.0.1", self.port))
+        sock.settimeout(5)
+        return sock
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.process.terminate()
+        try:
+            self.process.wait(5)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
+
+
+class server:
+    """Server that calls handle(sock) for each accepted connection in its own thread"""
+
+    def __init__(self, handle):
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen()
+        self.port = self.listener.getsockname()[1]
+        self.handle = handle
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def stop(self):
+        """Nothing listens on port after it"""
+        self.listener.shutdown(socket.SHUT_RDWR)
+        self.listener.close()
+
+    def accept(self):
+        while True:
+            try:
+                sock, _ = self.listener.accept()
+            except OSError:
+                return
+            sock.settimeout(5)
+            threading.Thread(target=self.serve, args=(sock,), daemon=True).start()
+
+    def serve(self, sock):
+        try:
+            self.handle(sock)
+        except (OSError, EOFError):
+            pass
+        finally:
+            sock.close()
+
+
+def read_header(sock, data=b""):
+    """Header of the next message and data read after it"""
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise EOFError("connection closed before end of header, got %r" % data)
+        data += chunk
+    header, _, rest = data.partition(b"\r\n\r\n")
+    return header.decode("latin-1"), rest
+
+
+def content_length(header):
+    for line in header.split("\r\n")[1:]:
+        name, _, value = line.partition(":")
+        if name.strip().lower() == "content-length":
+            return int(value)
+    return 0
+
+
+def read_response(sock, data=b""):
+    """Header and body of response with Content-Length, and data read after it"""
+    header, rest = read_header(sock, data)
+    length = content_length(header)
+    while len(rest) < length:
+        chunk = sock.recv(65536)
+        if not chunk:
+            fail("connection closed before end of body")
+        rest += chunk
+    return header, rest[:length], rest[length:]
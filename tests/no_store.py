@@ -0,0 +1,46 @@
+"""
+Responses that forbid caching are fetched from server every time
+"""
+
+import sys
+from email.utils import formatdate
+
+from harness import check, proxy, read_header, server
+
+requests = []
+
+
+def origin(sock):
+    data = b""
+    while True:
+        header, data = read_header(sock, data)
+        path = header.split("\r\n")[0].split(" ")[1]
+        requests.append(path)
+        # Fresh for a long time, so only the forbidding directive makes proxy ask server again
+        cache_control = {"/no-store": "no-store, max-age=600", "/private": "private, max-age=600",
+                         "/no-cache": "no-cache, max-age=600", "/public": "max-age=600"}[path]
+        sock.sendall(("HTTP/1.1 200 OK\r\nDate: %s\r\nCache-Control: %s\r\nETag: \"1\"\r\n"
+                      "Content-Length: 5\r\n\r\nhello" % (formatdate(usegmt=True), cache_control)).encode())
+
+
+def get(p, url):
+    client = p.connect()
+    client.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n"
+                    % (url, url.split("/")[2])).encode())
+    header, body = read_header(client)
+    while len(body) < 5:
+        chunk = client.recv(65536)
+        check(chunk, "response isn't complete")
+        body += chunk
+    check(body == b"hello", "wrong body %r" % body)
+
+
+upstream = server(origin)
+with proxy(sys.argv[1]) as p:
+    for path in ["/no-store", "/private", "/no-cache", "/public"]:
+        url = "http://127.0.0.1:%d%s" % (upstream.port, path)
+        get(p, url)
+        get(p, url)
+        expected = 1 if path == "/public" else 2
+        count = requests.count(path)
+        check(count == expected, "%s reached server %d times instead of %d" % (path, count, expected))
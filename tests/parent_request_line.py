@@ -0,0 +1,46 @@
+"""
+Requests that go through parent proxy keep a request line that parent understands:
+absolute URL for GET, host:port for CONNECT
+"""
+
+import sys
+
+from harness import check, proxy, read_header, read_response, server
+
+received = []
+
+
+def parent(sock):
+    header, rest = read_header(sock)
+    line = header.split("\r\n")[0]
+    received.append(line)
+    if line.startswith("CONNECT "):
+        sock.sendall(b"HTTP/1.1 200 Connection established\r\n\r\n")
+        data = sock.recv(65536)
+        sock.sendall(data.upper())
+        # Tunnel stays open until client closes it
+        sock.recv(65536)
+    else:
+        sock.sendall(b"HTTP/1.1 200 OK\r\nCache-Control: no-store\r\nContent-Length: 2\r\n\r\nok")
+
+
+upstream = server(parent)
+with proxy(sys.argv[1], "--parent=127.0.0.1:%d" % upstream.port, "--parent-check=0") as p:
+    client = p.connect()
+    client.sendall(b"CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n\r\n")
+    header, rest = read_header(client)
+    check(header.startswith("HTTP/1.1 200"), "tunnel isn't established: " + header)
+    client.sendall(b"ping")
+    while len(rest) < 4:
+        chunk = client.recv(65536)
+        check(chunk, "tunnel is closed")
+        rest += chunk
+    check(rest == b"PING", "tunnel doesn't pass data: %r" % rest)
+    check(received[-1] == "CONNECT example.com:443 HTTP/1.1", "parent got " + received[-1])
+    client.close()
+
+    client = p.connect()
+    client.sendall(b"GET http://example.com/path?q=1 HTTP/1.1\r\nHost: example.com\r\n\r\n")
+    header, body, _ = read_response(client)
+    check(body == b"ok", "response isn't forwarded: %r" % body)
+    check(received[-1] == "GET http://example.com/path?q=1 HTTP/1.1", "parent got " + received[-1])
@@ -0,0 +1,83 @@
+#include "arena.h"
+
+arena::arena(size_t block_size) : block_size(round_up(block_size)), blocks(), offset(0), live(0),
+                                  free_lists(),
+                                  allocations(0), heap_allocations(0) {
+}
+
+arena::~arena() {
+    release();
+}
+
+size_t arena::round_up(size_t size) {
+    size_t alignment = alignof(std::max_align_t);
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+void *arena::allocate(size_t size) {
+    size = round_up(size);
+    allocations++;
+    if (size > block_size) {
+        // Too big for blocks, it isn't kept after it's freed
+        heap_allocations++;
+        return ::operator new(size);
+    }
+
+    live++;
+    for (auto it = free_lists.begin(); it != free_lists.end(); it++) {
+        if (it->first == size && it->second != nullptr) {
+            free_node *node = it->second;
+            it->second = node->next;
+            return node;
+        }
+    }
+
+    if (blocks.empty() || block_size - offset < size) {
+        heap_allocations++;
+        blocks.push_back(static_cast<char *>(::operator new(block_size)));
+        offset = 0;
+    }
+    void *res = blocks.back() + offset;
+    offset += size;
+    return res;
+}
+
+void arena::deallocate(void *ptr, size_t size) {
+    size = round_up(size);
+    if (size > block_size) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    if (--live == 0) {
+        release();
+        return;
+    }
+    free_node *node = static_cast<free_node *>(ptr);
+    for (auto it = free_lists.begin(); it != free_lists.end(); it++) {
+        if (it->first == size) {
+            node->next = it->second;
+            it->second = node;
+            return;
+        }
+    }
+    node->next = nullptr;
+    free_lists.push_back({size, node});
+}
+
+void arena::release() {
+    for (auto it = blocks.begin(); it != blocks.end(); it++) {
+        ::operator delete(*it);
+    }
+    blocks.clear();
+    offset = 0;
+    free_lists.clear();
+}
+
+size_t arena::get_allocations() const {
+    return allocations;
+}
+
+size_t arena::get_heap_allocations() const {
+    return heap_allocations;
+}
@@ -0,0 +1,126 @@
+/*
+ * arena.h
+ *
+ * Memory of one client connection for objects that live during handling of its requests
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Memory is taken from big blocks by moving a pointer. Freed pieces are kept in lists by size and
+// given to next allocations of the same size. When nothing lives in arena, its blocks are returned to heap,
+// so idle arena doesn't hold memory
+struct arena {
+    explicit arena(size_t block_size);
+    arena(arena const &other) = delete;
+    arena &operator=(arena const &other) = delete;
+    ~arena();
+
+    void *allocate(size_t size);
+    void deallocate(void *ptr, size_t size);
+
+    // Number of allocations that were done by arena and that needed heap
+    size_t get_allocations() const;
+    size_t get_heap_allocations() const;
+
+private:
+    struct free_node {
+        free_node *next;
+    };
+
+    static size_t round_up(size_t size);
+    void release();
+
+    size_t block_size;
+    std::vector<char *> blocks;
+    size_t offset;                  // Used bytes of last block
+    size_t live;                    // Allocations in blocks that aren't freed yet
+    std::vector<std::pair<size_t, free_node *>> free_lists;
+    size_t allocations, heap_allocations;
+};
+
+// Allocator for std::allocate_shared and containers. Arena lives while something is allocated in it.
+// Without arena, memory is taken from heap
+template<typename T>
+struct arena_allocator {
+    using value_type = T;
+    // Containers take arena with their content, copies (e.g. headers saved to cache) outlive requests and use heap
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    arena_allocator();
+    arena_allocator(std::shared_ptr<arena> memory);
+    template<typename U>
+    arena_allocator(arena_allocator<U> const &other);
+
+    T *allocate(size_t n);
+    void deallocate(T *ptr, size_t n);
+
+    arena_allocator select_on_container_copy_construction() const;
+
+    template<typename U>
+    friend struct arena_allocator;
+    template<typename U, typename V>
+    friend bool operator==(arena_allocator<U> const &first, arena_allocator<V> const &second);
+private:
+    std::shared_ptr<arena> memory;
+};
+
+template<typename T, typename U>
+bool operator==(arena_allocator<T> const &first, arena_allocator<U> const &second) {
+    return first.memory == second.memory;
+}
+
+template<typename T, typename U>
+bool operator!=(arena_allocator<T> const &first, arena_allocator<U> const &second) {
+    return !(first == second);
+}
+
+template<typename T>
+arena_allocator<T>::arena_allocator() : memory() {
+}
+
+template<typename T>
+arena_allocator<T>::arena_allocator(std::shared_ptr<arena> memory) : memory(std::move(memory)) {
+}
+
+template<typename T>
+template<typename U>
+arena_allocator<T>::arena_allocator(arena_allocator<U> const &other) : memory(other.memory) {
+}
+
+template<typename T>
+T *arena_allocator<T>::allocate(size_t n) {
+    if (!memory) {
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T *>(memory->allocate(n * sizeof(T)));
+}
+
+template<typename T>
+void arena_allocator<T>::deallocate(T *ptr, size_t n) {
+    if (!memory) {
+        ::operator delete(ptr);
+        return;
+    }
+    memory->deallocate(ptr, n * sizeof(T));
+}
+
+template<typename T>
+arena_allocator<T> arena_allocator<T>::select_on_container_copy_construction() const {
+    return arena_allocator();
+}
+
+// Create shared object in <memory>
+template<typename T, typename... Args>
+std::shared_ptr<T> make_shared_in(std::shared_ptr<arena> const &memory, Args &&... args) {
+    return std::allocate_shared<T>(arena_allocator<T>(memory), std::forward<Args>(args)...);
+}
+
+#endif /* ARENA_H_ */
@@ -2,6 +2,11 @@
 
 raw_message::raw_message() : read_length(0), write_length(0) { }
 
+raw_message::raw_message(std::string const &data) : read_length(std::min(data.length(), (size_t) BUFFER_LENGTH)),
+                                                    write_length(0) {
+    data.copy(buffer, read_length);
+}
+
 raw_message::raw_message(raw_message const &other) :
         read_length(other.read_length), write_length(other.write_length) {
     for (size_t i = 0; i < other.read_length; i++) {
@@ -26,16 +31,25 @@ bool raw_message::can_write() const {
     return write_length < read_length;
 }
 
-void raw_message::read_from(file_descriptor const &fd) {
-    read_length += fd.read(buffer + read_length, BUFFER_LENGTH - read_length);
+io_result raw_message::read_from(file_descriptor const &fd) {
+    io_result res = fd.try_read(buffer + read_length, BUFFER_LENGTH - read_length);
+    if (res.is_ok()) {
+        read_length += res.get();
+    }
+    return res;
 }
 
-void raw_message::write_to(file_descriptor const &fd) {
-    write_length += fd.write(buffer + write_length, read_length - write_length);
+io_result raw_message::write_to(file_descriptor const &fd) {
+    io_result res = fd.try_write(buffer + write_length, read_length - write_length);
+    if (!res.is_ok()) {
+        return res;
+    }
+    write_length += res.get();
     if (write_length == BUFFER_LENGTH) {
         read_length = 0;
         write_length = 0;
     }
+    return res;
 }
 
 void swap(raw_message& first, raw_message& second) {
@@ -13,10 +13,14 @@
 
 #include "wraps.h"
 #include "header_parser.h"
+#include "char_scan.h"
+#include "chunked_parser.h"
 
 // Struct for messages with unlimited length and without HTTP headers
 struct raw_message {
     raw_message();
+    // Message that starts with <data> that was read before. It must fit into buffer
+    explicit raw_message(std::string const &data);
     raw_message(raw_message const& other);
     raw_message(raw_message&& other);
 
@@ -26,9 +30,9 @@ struct raw_message {
     bool can_read() const;
     bool can_write() const;
 
-    // Read or Write
-    void read_from(file_descriptor const& fd);
-    void write_to(file_descriptor const& fd);
+    // Read or Write. I/O errors are returned, message isn't changed by them
+    io_result read_from(file_descriptor const& fd);
+    io_result write_to(file_descriptor const& fd);
 
     friend void swap(raw_message& first, raw_message& second);
 private:
@@ -50,7 +54,11 @@ struct buffered_message {
     static const size_t BUFFER_LENGTH = 8 * 1024;   // Maximal length of request's header supported by web-browsers
 
     buffered_message();
+    // Header that is read is kept in <memory>
+    explicit buffered_message(std::shared_ptr<arena> memory);
     buffered_message(cached_message cache);
+    // Message from cache with header that was parsed before
+    buffered_message(cached_message cache, T const &header);
     buffered_message(T const &header, std::string const &body);
     buffered_message(buffered_message const &other);
     buffered_message(buffered_message &&other);
@@ -65,23 +73,68 @@ struct buffered_message {
     bool is_read() const;
     bool is_written() const;
 
-    void read_from(file_descriptor const &socket);
-    void write_to(file_descriptor const &socket);
+    // Number of bytes that were read, but weren't written yet
+    size_t get_unsent_length() const;
+
+    // Length of body that isn't read yet, INF if it isn't known (E.G. chunked body)
+    size_t get_body_left() const;
+    // <length> bytes of body were moved past the message (E.G. spliced between sockets). They count as
+    // read and written, but aren't kept in cache
+    void skip_body(size_t length);
+
+    // If disabled, parts of message are freed right after they are written. Cache becomes incomplete
+    void set_cache_enabled(bool enabled);
+
+    // Message ends with its header whatever the header says (E.G. response to HEAD). Set before reading
+    void set_bodyless(bool bodyless);
+
+    // I/O errors are returned, message isn't changed by them. Malformed message throws annotated_exception
+    io_result read_from(file_descriptor const &socket);
+    io_result write_to(file_descriptor const &socket);
+
+    // Take all data that can be written now (E.G. for transforming it before sending)
+    void write_to(std::string &out);
+
+    // Read data that was received before. What doesn't belong to this message is saved as rest
+    void read_from(std::string const &data);
+
+    // Data that was read after the end of message (E.G. next pipelined request)
+    bool has_rest() const;
+    std::string take_rest();
 
     // Get cache or cached header
-    cached_message get_cache() const;
-    T get_header() const;
+    cached_message const &get_cache() const;
+    T const &get_header() const;
+
+    // Replace header that wasn't written yet (E.G. to drop fields that proxy handles itself)
+    void set_header(T const &new_header);
+    // Replace only what is written instead of header, parsed header stays (E.G. absolute URL for parent proxy)
+    void set_written_header(T const &new_header);
+
+    // Trailer fields of chunked message
+    std::vector<header_property> const &get_trailers() const;
 
     template<typename S>
     friend void swap(buffered_message<S> &first, buffered_message<S> &second);
 private:
+    // How many bytes can be read to buffer now
+    size_t get_should_read() const;
+    // Handle <length> bytes that were added to buffer
+    void handle_read(size_t length);
+
     size_t header_length, body_length, read;
     size_t read_length, write_length;
+    size_t unsent_length;
+    bool cache_enabled;
+    bool bodyless;
     T header;
+    chunked_parser chunked;         // Used if body_length is INF
     char buffer[BUFFER_LENGTH];
 
     size_t cur_part;
     std::vector<std::string> cache;
+    std::string rest;
+    std::shared_ptr<arena> memory;
 };
 
 using client_request = buffered_message<request_header>;
@@ -90,14 +143,24 @@ using server_response = buffered_message<response_header>;
 template<typename T>
 buffered_message<T>::buffered_message() :
         header_length(0), body_length(INF), read(0), read_length(0), write_length(0),
-        header(T()), cur_part(0), cache{} {
+        unsent_length(0), cache_enabled(true), bodyless(false), header(T()), cur_part(0), cache{} {
+}
+
+template<typename T>
+buffered_message<T>::buffered_message(std::shared_ptr<arena> memory) : buffered_message() {
+    this->memory = std::move(memory);
 }
 
 template<typename T>
 buffered_message<T>::buffered_message(cached_message cache)
+        : buffered_message(cache, T(cache[0])) { // Header saved in 0th part
+}
+
+template<typename T>
+buffered_message<T>::buffered_message(cached_message cache, T const &header)
         : buffered_message() {
-    header = T(cache[0]); // Header saved in 0th part
-    this->cache = cache;
+    this->header = header;
+    this->cache = std::move(cache);
 
     header_length = 0; // Header isn't important now
 
@@ -109,12 +172,15 @@ buffered_message<T>::buffered_message(cached_message cache)
     read = body_length;
 
     read_length = 0;
+    unsent_length = body_length;
 
     cur_part = 0;
 }
 
 template<typename T>
-buffered_message<T>::buffered_message(T const &header, std::string const &body) : header(header),
+buffered_message<T>::buffered_message(T const &header, std::string const &body) : cache_enabled(true),
+                                                                                  bodyless(false),
+                                                                                  header(header),
                                                                                   cur_part(0),
                                                                                   cache{} {
     std::string message = to_string(header);
@@ -128,6 +194,7 @@ buffered_message<T>::buffered_message(T const &header, std::string const &body)
     read_length = header_length + body_length;
 
     write_length = 0;
+    unsent_length = message.length();
     cache.push_back(message);
     cur_part = 0;
 }
@@ -135,12 +202,13 @@ buffered_message<T>::buffered_message(T const &header, std::string const &body)
 template<typename T>
 buffered_message<T>::buffered_message(buffered_message<T> const &other) :
         header_length(other.header_length), body_length(other.body_length), read(other.read),
-        read_length(other.read_length), write_length(other.write_length), header(other.header),
-        cur_part(other.cur_part), cache(other.cache) {
+        read_length(other.read_length), write_length(other.write_length), unsent_length(other.unsent_length),
+        cache_enabled(other.cache_enabled), bodyless(other.bodyless), header(other.header), chunked(other.chunked),
+        cur_part(other.cur_part), cache(other.cache), rest(other.rest) {
 }
 
 template<typename T>
-buffered_message<T>::buffered_message(buffered_message<T> &&other) {
+buffered_message<T>::buffered_message(buffered_message<T> &&other) : buffered_message() {
     swap(*this, other);
 }
 
@@ -159,10 +227,16 @@ void swap(buffered_message<T> &first, buffered_message<T> &second) {
     swap(first.read, second.read);
     swap(first.read_length, second.read_length);
     swap(first.write_length, second.write_length);
+    swap(first.unsent_length, second.unsent_length);
+    swap(first.cache_enabled, second.cache_enabled);
+    swap(first.bodyless, second.bodyless);
     swap(first.header, second.header);
+    swap(first.chunked, second.chunked);
 
     swap(first.cur_part, second.cur_part);
     first.cache.swap(second.cache);
+    first.rest.swap(second.rest);
+    swap(first.memory, second.memory);
 }
 
 template<typename T>
@@ -185,90 +259,203 @@ bool buffered_message<T>::is_written() const {
     return is_read() && cur_part == cache.size();
 }
 
+template<typename T>
+size_t buffered_message<T>::get_unsent_length() const {
+    return unsent_length;
+}
+
+template<typename T>
+size_t buffered_message<T>::get_body_left() const {
+    return body_length == INF ? INF : body_length - read;
+}
+
+template<typename T>
+void buffered_message<T>::skip_body(size_t length) {
+    read += length;
+}
+
+template<typename T>
+void buffered_message<T>::set_cache_enabled(bool enabled) {
+    cache_enabled = enabled;
+}
+
+template<typename T>
+void buffered_message<T>::set_bodyless(bool bodyless) {
+    this->bodyless = bodyless;
+}
+
 template<typename T>
 bool buffered_message<T>::is_header_read() const {
     return header_length != 0;
 }
 
 template<typename T>
-T buffered_message<T>::get_header() const {
+T const &buffered_message<T>::get_header() const {
     return header;
 }
 
+template<typename T>
+void buffered_message<T>::set_header(T const &new_header) {
+    set_written_header(new_header);
+    header = new_header;
+}
 
 template<typename T>
-void buffered_message<T>::read_from(file_descriptor const &socket) {
-    size_t should_read =
-            (body_length - read > BUFFER_LENGTH - read_length) ? BUFFER_LENGTH - read_length : body_length - read;
+void buffered_message<T>::set_written_header(T const &new_header) {
+    std::string message = to_string(new_header);
+    cache[0].replace(0, header_length, message);
+    unsent_length = unsent_length - header_length + message.length();
+    header_length = message.length();
+}
 
-    long read_length_cur = socket.read(buffer + read_length, should_read);
+template<typename T>
+io_result buffered_message<T>::read_from(file_descriptor const &socket) {
+    io_result res = socket.try_read(buffer + read_length, get_should_read());
+    if (res.is_ok()) {
+        handle_read((size_t) res.get());
+    }
+    return res;
+}
 
+template<typename T>
+void buffered_message<T>::read_from(std::string const &data) {
+    size_t offset = 0;
+    while (offset < data.length() && can_read()) {
+        size_t length = std::min(get_should_read(), data.length() - offset);
+        if (length == 0) {
+            break;
+        }
+        data.copy(buffer + read_length, length, offset);
+        offset += length;
+        handle_read(length);
+    }
+    rest.append(data, offset, std::string::npos);
+}
+
+template<typename T>
+bool buffered_message<T>::has_rest() const {
+    return !rest.empty();
+}
+
+template<typename T>
+std::string buffered_message<T>::take_rest() {
+    std::string result;
+    result.swap(rest);
+    return result;
+}
+
+template<typename T>
+size_t buffered_message<T>::get_should_read() const {
+    return (body_length - read > BUFFER_LENGTH - read_length) ? BUFFER_LENGTH - read_length : body_length - read;
+}
+
+template<typename T>
+void buffered_message<T>::handle_read(size_t read_length_cur) {
     read_length += read_length_cur;
     std::string message(buffer, read_length);
     if (header_length == 0) {
-        size_t pos = message.find("\r\n\r\n");
-        if (pos == std::string::npos)
-            pos = message.find("\n\n");
-
+        size_t pos = find_header_end(message);
         if (pos != std::string::npos) {
-            pos += 4; // Skip \r\n\r\n
             std::string body = message.substr(pos);
-            size_t read_body_length = body.length();
-            header = T(message);
-
-            // Modify header
+            header = T(message, memory);
+
+            // Transfer-encoding overrides content-length
+            if (bodyless) {
+                body_length = 0;
+            } else if (to_lower(header.get_property(header_name::TRANSFER_ENCODING)).find("chunked") !=
+                       std::string::npos) {
+                body_length = INF;
+            } else if (header.has_property(header_name::CONTENT_LENGTH)) {
+                body_length = header.get_int(header_name::CONTENT_LENGTH);
+            } else {
+                // ???
+                body_length = 0;
+            }
 
-            // And save
+            size_t message_end = (body_length == INF) ? chunked.feed(body.data(), body.length()) : body_length;
+            if (body.length() > message_end) {
+                // Beginning of the next message was read too
+                rest = body.substr(message_end);
+                body.resize(message_end);
+            }
+            size_t read_body_length = body.length();
 
             message = to_string(header);
             header_length = message.length();
 
             message += body;
 
-            if (header.has_property("content-length")) {
-                body_length = header.get_int("content-length");
-            } else {
-                if (header.get_property("transfer-encoding").compare("chunked") == 0) {
-                    body_length = INF;
-                } else {
-                    // ???
-                    body_length = 0;
-                }
-            }
-
             read = read_body_length;
 
-            cache.push_back(message);
+            unsent_length += message.length();
+            cache.push_back(std::move(message));
             read_length = 0;
             cur_part = 0;
         }
     } else {
-        read += read_length_cur;
-        cache.push_back(message);
+        if (body_length == INF) {
+            size_t message_end = chunked.feed(message.data(), message.length());
+            if (message.length() > message_end) {
+                rest = message.substr(message_end);
+                message.resize(message_end);
+            }
+        }
+        read += message.length();
+        unsent_length += message.length();
+        cache.push_back(std::move(message));
         read_length = 0;
     }
 
-    if (body_length == INF) {
-        if (message.length() >= 5 && message.substr(message.length() - 5).compare("0\r\n\r\n") == 0) {
-            body_length = read;
-        }
+    if (body_length == INF && chunked.is_finished()) {
+        body_length = read;
     }
 }
 
 template<typename T>
-void buffered_message<T>::write_to(file_descriptor const &socket) {
-    long write_length_cur = socket.write(cache[cur_part].c_str() + write_length,
-                                         cache[cur_part].length() - write_length);
+std::vector<header_property> const &buffered_message<T>::get_trailers() const {
+    return chunked.get_trailers();
+}
+
+template<typename T>
+io_result buffered_message<T>::write_to(file_descriptor const &socket) {
+    if (!can_write()) {
+        return io_result();
+    }
+    io_result res = socket.try_write(cache[cur_part].c_str() + write_length,
+                                     cache[cur_part].length() - write_length);
+    if (!res.is_ok()) {
+        return res;
+    }
+    long write_length_cur = res.get();
     write_length += write_length_cur;
+    unsent_length -= write_length_cur;
     // Next part of cache
     if (write_length == cache[cur_part].length()) {
+        if (!cache_enabled) {
+            // Nobody needs this part anymore
+            std::string().swap(cache[cur_part]);
+        }
+        write_length = 0;
+        cur_part++;
+    }
+    return res;
+}
+
+template<typename T>
+void buffered_message<T>::write_to(std::string &out) {
+    while (can_write()) {
+        out.append(cache[cur_part], write_length, std::string::npos);
+        unsent_length -= cache[cur_part].length() - write_length;
+        if (!cache_enabled) {
+            std::string().swap(cache[cur_part]);
+        }
         write_length = 0;
         cur_part++;
     }
 }
 
 template<typename T>
-cached_message buffered_message<T>::get_cache() const {
+cached_message const &buffered_message<T>::get_cache() const {
     return cache;
 }
 
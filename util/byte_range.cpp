@@ -0,0 +1,233 @@
+#include "byte_range.h"
+
+#include <cstdio>
+#include <algorithm>
+
+namespace {
+    const size_t MAX_RANGES = 16;       // More ranges are ignored, they can be used for amplification
+    char const *const BOUNDARY = "proxy_server_byteranges_3f1c9a";
+
+    bool parse_number(std::string const &str, size_t &value) {
+        if (str.empty() || str.size() > 18 || str.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        value = std::stoull(str);
+        return true;
+    }
+
+    size_t get_size(cached_message const &message) {
+        size_t size = 0;
+        for (auto it = message.begin(); it != message.end(); it++) {
+            size += it->size();
+        }
+        return size;
+    }
+
+    // Append <count> bytes of message starting at <offset> to <out>
+    void copy_bytes(cached_message const &message, size_t offset, size_t count, std::string &out) {
+        for (auto it = message.begin(); it != message.end() && count > 0; it++) {
+            if (offset >= it->size()) {
+                offset -= it->size();
+                continue;
+            }
+            size_t length = std::min(count, it->size() - offset);
+            out.append(*it, offset, length);
+            count -= length;
+            offset = 0;
+        }
+    }
+
+    std::string to_content_range(byte_range const &range, size_t length) {
+        return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" +
+               std::to_string(length);
+    }
+}
+
+bool parse_ranges(std::string const &value, size_t length, std::vector<byte_range> &ranges) {
+    std::string str = to_lower(trim(value));
+    if (str.compare(0, 6, "bytes=") != 0) {
+        return false;
+    }
+
+    ranges.clear();
+    size_t count = 0;
+    size_t begin = 6;
+    while (begin <= str.size()) {
+        size_t end = std::min(str.find(',', begin), str.size());
+        std::string spec = trim(str.substr(begin, end - begin));
+        begin = end + 1;
+        if (spec.empty()) {
+            continue;
+        }
+        if (++count > MAX_RANGES) {
+            return false;
+        }
+
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos) {
+            return false;
+        }
+        std::string first_str = spec.substr(0, dash);
+        std::string last_str = spec.substr(dash + 1);
+        size_t first, last;
+
+        if (first_str.empty()) {
+            // Suffix: last N bytes
+            if (!parse_number(last_str, last)) {
+                return false;
+            }
+            if (last > 0 && length > 0) {
+                ranges.push_back({length - std::min(last, length), length - 1});
+            }
+            continue;
+        }
+
+        if (!parse_number(first_str, first)) {
+            return false;
+        }
+        if (last_str.empty()) {
+            last = length - 1;
+        } else if (!parse_number(last_str, last) || last < first) {
+            return false;
+        }
+        if (first < length) {
+            ranges.push_back({first, std::min(last, length - 1)});
+        }
+    }
+    return count > 0;
+}
+
+size_t find_body(cached_message const &message) {
+    static char const END[] = "\r\n\r\n";
+
+    size_t matched = 0;
+    size_t offset = 0;
+    for (auto it = message.begin(); it != message.end(); it++) {
+        for (char c : *it) {
+            offset++;
+            if (c == END[matched]) {
+                if (++matched == 4) {
+                    return offset;
+                }
+            } else {
+                matched = c == '\r' ? 1 : 0;
+            }
+        }
+    }
+    return std::string::npos;
+}
+
+cached_message slice_ranges(cached_message const &message, std::vector<byte_range> const &ranges) {
+    size_t body = find_body(message);
+    size_t length = get_size(message) - body;
+
+    std::string header_str;
+    copy_bytes(message, 0, body, header_str);
+    response_header header(header_str);
+
+    cached_message res(1);
+    if (ranges.empty()) {
+        header.set_request_line(response_line(416, "Range Not Satisfiable"));
+        header.set_property(header_name::CONTENT_RANGE, "bytes */" + std::to_string(length));
+        header.set_property(header_name::CONTENT_LENGTH, "0");
+    } else if (ranges.size() == 1) {
+        byte_range const &range = ranges[0];
+        header.set_request_line(response_line(206, "Partial Content"));
+        header.set_property(header_name::CONTENT_RANGE, to_content_range(range, length));
+        header.set_property(header_name::CONTENT_LENGTH, std::to_string(range.last - range.first + 1));
+
+        res.push_back("");
+        copy_bytes(message, body + range.first, range.last - range.first + 1, res.back());
+    } else {
+        std::string content_type = header.get_property(header_name::CONTENT_TYPE);
+        size_t content_length = 0;
+        for (auto it = ranges.begin(); it != ranges.end(); it++) {
+            std::string delimiter = "\r\n--" + std::string(BOUNDARY) + "\r\n";
+            if (!content_type.empty()) {
+                delimiter += "Content-Type: " + content_type + "\r\n";
+            }
+            delimiter += "Content-Range: " + to_content_range(*it, length) + "\r\n\r\n";
+            res.push_back(std::move(delimiter));
+
+            res.push_back("");
+            copy_bytes(message, body + it->first, it->last - it->first + 1, res.back());
+            content_length += res[res.size() - 2].size() + res.back().size();
+        }
+        res.push_back("\r\n--" + std::string(BOUNDARY) + "--\r\n");
+        content_length += res.back().size();
+
+        header.set_request_line(response_line(206, "Partial Content"));
+        header.set_property(header_name::CONTENT_TYPE, "multipart/byteranges; boundary=" + std::string(BOUNDARY));
+        header.set_property(header_name::CONTENT_LENGTH, std::to_string(content_length));
+    }
+    res[0] = to_string(header);
+    return res;
+}
+
+sparse_entity::sparse_entity() : header(), length(0), parts() {
+}
+
+bool sparse_entity::add(cached_message const &response) {
+    size_t body = find_body(response);
+    if (body == std::string::npos) {
+        return false;
+    }
+    std::string message;
+    copy_bytes(response, 0, get_size(response), message);
+    response_header part_header(message.substr(0, body));
+
+    unsigned long long first, last, total;
+    std::string content_range = to_lower(part_header.get_property(header_name::CONTENT_RANGE));
+    if (part_header.get_request_line().get_code() != 206 || part_header.has_property(header_name::TRANSFER_ENCODING) ||
+        sscanf(content_range.c_str(), "bytes %llu-%llu/%llu", &first, &last, &total) != 3 ||
+        first > last || last >= total || total > MAX_LENGTH || message.size() - body != last - first + 1) {
+        return false;
+    }
+
+    // Parts of one entity have the same validators
+    std::string etag = part_header.get_property(header_name::ETAG);
+    std::string last_modified = part_header.get_property(header_name::LAST_MODIFIED);
+    if (etag.empty() && last_modified.empty()) {
+        return false;
+    }
+    if (parts.empty()) {
+        header = part_header;
+        length = total;
+    } else if (total != length || etag.compare(header.get_property(header_name::ETAG)) != 0 ||
+               last_modified.compare(header.get_property(header_name::LAST_MODIFIED)) != 0) {
+        return false;
+    }
+
+    std::string &part = parts[first];
+    if (part.size() < last - first + 1) {
+        part = message.substr(body);
+    }
+    return true;
+}
+
+bool sparse_entity::is_complete() const {
+    size_t covered = 0;
+    for (auto it = parts.begin(); it != parts.end(); it++) {
+        if (it->first > covered) {
+            return false;
+        }
+        covered = std::max(covered, it->first + it->second.size());
+    }
+    return !parts.empty() && covered >= length;
+}
+
+cached_message sparse_entity::get_complete() const {
+    std::string body;
+    body.reserve(length);
+    for (auto it = parts.begin(); it != parts.end(); it++) {
+        if (it->first + it->second.size() > body.size()) {
+            body.append(it->second, body.size() - it->first, std::string::npos);
+        }
+    }
+
+    response_header complete = header;
+    complete.set_request_line(response_line(200, "OK"));
+    complete.erase_property(header_name::CONTENT_RANGE);
+    complete.set_property(header_name::CONTENT_LENGTH, std::to_string(length));
+    return {to_string(complete), std::move(body)};
+}
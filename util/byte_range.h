@@ -0,0 +1,53 @@
+/*
+ * byte_range.h
+ *
+ * Byte ranges of cached responses (Range, 206 Partial Content)
+ */
+
+#ifndef BYTE_RANGE_H_
+#define BYTE_RANGE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "header_parser.h"
+#include "buffered_message.h"
+
+// Range of bytes from <first> to <last> inclusive
+struct byte_range {
+    size_t first, last;
+};
+
+// Parse value of Range header for entity of <length> bytes. Returns false if it isn't a valid
+// "bytes" range and should be ignored. Unsatisfiable ranges are skipped, so <ranges> can become empty
+bool parse_ranges(std::string const &value, size_t length, std::vector<byte_range> &ranges);
+
+// Offset of body in message, npos if message has no complete header
+size_t find_body(cached_message const &message);
+
+// Response with <ranges> of body of complete 200 response <message>: 206 with single range or
+// multipart/byteranges, 416 if <ranges> are empty. Only bytes of ranges are copied
+cached_message slice_ranges(cached_message const &message, std::vector<byte_range> const &ranges);
+
+// Entity that is received by parts in 206 responses. When parts cover it all, it can be cached as 200
+struct sparse_entity {
+    sparse_entity();
+
+    // Add 206 response with single range. Returns false if response doesn't belong to this entity
+    bool add(cached_message const &response);
+
+    bool is_complete() const;
+
+    // Whole entity as 200 response
+    cached_message get_complete() const;
+
+private:
+    static const size_t MAX_LENGTH = 16 * 1024 * 1024;
+
+    response_header header;
+    size_t length;
+    std::map<size_t, std::string> parts;    // Received parts by offset, they can overlap
+};
+
+#endif /* BYTE_RANGE_H_ */
@@ -0,0 +1,78 @@
+#include "cache_entry.h"
+
+#include "util.h"
+
+namespace {
+    // Weak comparison, W/ prefix is ignored
+    std::string strip_weak(std::string const &tag) {
+        return tag.compare(0, 2, "W/") == 0 ? tag.substr(2) : tag;
+    }
+}
+
+cache_entry::cache_entry(cached_message message, response_header header, long default_while_revalidate,
+                         long default_if_error, time_t now) :
+        message(std::move(message)), header(std::move(header)),
+        etag(this->header.get_property(header_name::ETAG)),
+        last_modified(this->header.get_property(header_name::LAST_MODIFIED)),
+        fresh(this->header, default_while_revalidate, default_if_error, now) {
+}
+
+cache_entry::cache_entry(cached_message message, long default_while_revalidate, long default_if_error,
+                         time_t now) :
+        cache_entry(message, response_header(message[0]),
+                    default_while_revalidate, default_if_error, now) {
+}
+
+bool cache_entry::matches_conditions(request_header const &request) const {
+    if (request.has_property(header_name::IF_NONE_MATCH)) {
+        if (etag.empty()) {
+            return false;
+        }
+        std::string const &tags = request.get_property(header_name::IF_NONE_MATCH);
+        std::string own = strip_weak(etag);
+        size_t begin = 0;
+        while (begin <= tags.length()) {
+            size_t end = tags.find(',', begin);
+            if (end == std::string::npos) {
+                end = tags.length();
+            }
+            std::string tag = trim(tags.substr(begin, end - begin));
+            if (tag == "*" || strip_weak(tag) == own) {
+                return true;
+            }
+            begin = end + 1;
+        }
+        return false;
+    }
+
+    // If-Modified-Since is ignored when If-None-Match is present
+    if (request.has_property(header_name::IF_MODIFIED_SINCE) && !last_modified.empty()) {
+        time_t since = parse_http_date(request.get_property(header_name::IF_MODIFIED_SINCE));
+        time_t modified = parse_http_date(last_modified);
+        return since != -1 && modified != -1 && modified <= since;
+    }
+    return false;
+}
+
+response_header cache_entry::get_not_modified_header() const {
+    static header_name::id const KEPT[] = {
+            header_name::DATE, header_name::ETAG, header_name::CACHE_CONTROL, header_name::EXPIRES,
+            header_name::VARY, header_name::LAST_MODIFIED
+    };
+
+    response_header res(response_line(304, "Not Modified"));
+    for (header_name::id name : KEPT) {
+        if (header.has_property(name)) {
+            res.set_property(name, header.get_property(name));
+        }
+    }
+    return res;
+}
+
+size_t cache_entry::get_size() const {
+    size_t size = 0;
+    for (auto it = message.begin(); it != message.end(); it++) {
+        size += it->length();
+    }
+    return size;
+}
@@ -0,0 +1,41 @@
+/*
+ * cache_entry.h
+ *
+ * Response saved in memory cache
+ */
+
+#ifndef CACHE_ENTRY_H_
+#define CACHE_ENTRY_H_
+
+#include <string>
+#include <ctime>
+
+#include "header_parser.h"
+#include "buffered_message.h"
+#include "freshness.h"
+
+// Cached response with everything that is needed to serve or validate it. Header is parsed once,
+// when the response is saved, so cache hits don't run header parser. Entry isn't changed after that
+struct cache_entry {
+    // Entry of response with already parsed <header>
+    cache_entry(cached_message message, response_header header, long default_while_revalidate,
+                long default_if_error, time_t now);
+    // Entry of response that wasn't parsed (E.G. loaded from disk)
+    cache_entry(cached_message message, long default_while_revalidate, long default_if_error, time_t now);
+
+    size_t get_size() const;
+
+    // True if conditional request can be answered with 304 by this entry (If-None-Match, otherwise
+    // If-Modified-Since). False for unconditional request
+    bool matches_conditions(request_header const &request) const;
+
+    // Header of 304 response to conditional request that matches the entry
+    response_header get_not_modified_header() const;
+
+    cached_message const message;
+    response_header const header;
+    std::string const etag, last_modified;     // Validators
+    freshness const fresh;                     // Freshness at time of saving
+};
+
+#endif /* CACHE_ENTRY_H_ */
@@ -0,0 +1,157 @@
+#include "cache_key.h"
+
+#include <algorithm>
+
+namespace {
+    bool is_unreserved(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '-' || c == '.' || c == '_' || c == '~';
+    }
+
+    int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // Decode escaped unreserved characters and write other escapes in upper case
+    std::string normalize_escapes(std::string const &str) {
+        static char const HEX[] = "0123456789ABCDEF";
+
+        std::string res;
+        res.reserve(str.size());
+        for (size_t i = 0; i < str.size(); i++) {
+            if (str[i] == '%' && i + 2 < str.size() &&
+                hex_value(str[i + 1]) >= 0 && hex_value(str[i + 2]) >= 0) {
+                char c = (char) (hex_value(str[i + 1]) * 16 + hex_value(str[i + 2]));
+                if (is_unreserved(c)) {
+                    res += c;
+                } else {
+                    res += '%';
+                    res += HEX[(unsigned char) c >> 4];
+                    res += HEX[(unsigned char) c & 15];
+                }
+                i += 2;
+            } else {
+                res += str[i];
+            }
+        }
+        return res;
+    }
+}
+
+std::string normalize_host(std::string host) {
+    host = to_lower(trim(host));
+
+    // Port is after the last ':', but not inside of IPv6 literal
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+        std::string port = host.substr(colon + 1);
+        if (port.empty() || port.compare("80") == 0) {
+            host.erase(colon);
+        }
+    }
+
+    // "example.com." is the same as "example.com"
+    if (!host.empty() && host.back() == '.') {
+        host.pop_back();
+    }
+    return host;
+}
+
+std::string normalize_path(std::string const &url, bool sort_query) {
+    std::string path = url.substr(0, url.find('#'));
+    size_t question = path.find('?');
+
+    std::string res = normalize_escapes(path.substr(0, question));
+    if (res.empty()) {
+        res = "/";
+    }
+    if (question == std::string::npos) {
+        return res;
+    }
+
+    std::vector<std::string> params;
+    size_t begin = question + 1;
+    while (begin <= path.size()) {
+        size_t end = std::min(path.find('&', begin), path.size());
+        if (end > begin) {
+            params.push_back(normalize_escapes(path.substr(begin, end - begin)));
+        }
+        begin = end + 1;
+    }
+    if (sort_query) {
+        std::stable_sort(params.begin(), params.end());
+    }
+
+    res += '?';
+    for (size_t i = 0; i < params.size(); i++) {
+        if (i > 0) {
+            res += '&';
+        }
+        res += params[i];
+    }
+    return res;
+}
+
+cache_key_builder::cache_key_builder(bool sort_query) : sort_query(sort_query), vary() {
+}
+
+std::string cache_key_builder::get_url(request_header const &request) const {
+    return normalize_host(request.get_property(header_name::HOST)) +
+           normalize_path(request.get_request_line().get_url(), sort_query);
+}
+
+std::string cache_key_builder::get_key(request_header const &request) const {
+    std::string url = get_url(request);
+    if (!vary.has(url)) {
+        return url;
+    }
+    fields_t const &fields = vary.find(url);
+    return make_key(std::move(url), fields, request);
+}
+
+std::string cache_key_builder::add_variant(request_header const &request, response_header const &response) {
+    std::string url = get_url(request);
+
+    fields_t fields;
+    std::string value = to_lower(response.get_property(header_name::VARY));
+    size_t begin = 0;
+    while (begin <= value.size()) {
+        size_t end = std::min(value.find(',', begin), value.size());
+        std::string field = trim(value.substr(begin, end - begin));
+        if (!field.empty()) {
+            fields.push_back(field);
+        }
+        begin = end + 1;
+    }
+    std::sort(fields.begin(), fields.end());
+    fields.erase(std::unique(fields.begin(), fields.end()), fields.end());
+
+    // Vary may change, the last one is used for lookups
+    vary.erase(url);
+    if (fields.empty()) {
+        return url;
+    }
+    vary.insert(url, fields);
+    return make_key(std::move(url), fields, request);
+}
+
+std::string cache_key_builder::make_key(std::string url, fields_t const &fields,
+                                        request_header const &request) const {
+    // Header values can't contain line breaks, so keys of different variants differ
+    for (auto it = fields.begin(); it != fields.end(); it++) {
+        url += '\n';
+        url += *it;
+        url += ": ";
+        url += trim(request.get_property(*it));
+    }
+    return url;
+}
@@ -0,0 +1,46 @@
+/*
+ * cache_key.h
+ *
+ * Normalized and Vary-aware keys of response cache
+ */
+
+#ifndef CACHE_KEY_H_
+#define CACHE_KEY_H_
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "header_parser.h"
+
+// Builds keys of cache. Equivalent URLs (case of host, default port, percent-encoding and,
+// if enabled, order of query parameters) give the same key. Responses with Vary are stored
+// as variants of URL: key of variant contains values of request headers named in Vary
+struct cache_key_builder {
+    explicit cache_key_builder(bool sort_query = false);
+
+    // Normalized "host[:port]/path[?query]" of request
+    std::string get_url(request_header const &request) const;
+
+    // Key of the variant of cached response that suits request
+    std::string get_key(request_header const &request) const;
+
+    // Remember Vary of response to request and return key the response should be saved with
+    std::string add_variant(request_header const &request, response_header const &response);
+
+private:
+    static const size_t MAX_VARY_URLS = 20000;
+
+    using fields_t = std::vector<std::string>;
+
+    std::string make_key(std::string url, fields_t const &fields, request_header const &request) const;
+
+    bool sort_query;
+    simple_cache<std::string, fields_t, MAX_VARY_URLS> vary;    // Fields of Vary by URL
+};
+
+// Normalization of parts of URL
+std::string normalize_host(std::string host);
+std::string normalize_path(std::string const &url, bool sort_query);
+
+#endif /* CACHE_KEY_H_ */
@@ -0,0 +1,76 @@
+#include "cache_snapshot.h"
+
+#include <stdio.h>
+
+namespace {
+    const uint32_t SNAPSHOT_MAGIC = 0x4e535850;     // "PXSN"
+    const uint32_t SNAPSHOT_VERSION = 1;
+    const uint64_t MAX_MESSAGE_LENGTH = (uint64_t) 1 << 32;
+}
+
+snapshot_writer::snapshot_writer(std::string const &path) : path(path), tmp_path(path + ".tmp"),
+                                                            out(tmp_path, std::ios::binary | std::ios::trunc) {
+    if (!out) {
+        throw annotated_exception("snapshot", "can't open " + tmp_path);
+    }
+    out.write(reinterpret_cast<char const *>(&SNAPSHOT_MAGIC), sizeof SNAPSHOT_MAGIC);
+    out.write(reinterpret_cast<char const *>(&SNAPSHOT_VERSION), sizeof SNAPSHOT_VERSION);
+}
+
+void snapshot_writer::write(std::string const &key, cached_message const &message) {
+    uint32_t key_length = (uint32_t) key.length();
+    uint64_t message_length = 0;
+    for (auto it = message.begin(); it != message.end(); it++) {
+        message_length += it->length();
+    }
+    out.write(reinterpret_cast<char const *>(&key_length), sizeof key_length);
+    out.write(key.data(), key.length());
+    out.write(reinterpret_cast<char const *>(&message_length), sizeof message_length);
+    for (auto it = message.begin(); it != message.end(); it++) {
+        out.write(it->data(), it->length());
+    }
+}
+
+void snapshot_writer::commit() {
+    out.close();
+    if (!out) {
+        throw annotated_exception("snapshot", "can't write " + tmp_path);
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) == -1) {
+        int err = errno;
+        throw annotated_exception("snapshot", err);
+    }
+}
+
+snapshot_reader::snapshot_reader(std::string const &path) : in(path, std::ios::binary) {
+    if (!in) {
+        throw annotated_exception("snapshot", "can't open " + path);
+    }
+    uint32_t magic = 0, version = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof magic);
+    in.read(reinterpret_cast<char *>(&version), sizeof version);
+    if (!in || magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION) {
+        throw annotated_exception("snapshot", path + " isn't a snapshot of cache");
+    }
+}
+
+bool snapshot_reader::next(std::string &key, cached_message &message) {
+    uint32_t key_length = 0;
+    if (!in.read(reinterpret_cast<char *>(&key_length), sizeof key_length)) {
+        return false;
+    }
+    key.resize(key_length);
+    uint64_t message_length = 0;
+    if (!in.read(&key[0], key_length) ||
+        !in.read(reinterpret_cast<char *>(&message_length), sizeof message_length) ||
+        message_length > MAX_MESSAGE_LENGTH) {
+        return false;
+    }
+    std::string data(message_length, '\0');
+    if (!in.read(&data[0], message_length)) {
+        // Snapshot is truncated
+        return false;
+    }
+    message = cached_message{std::move(data)};
+    return true;
+}
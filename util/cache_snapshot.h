@@ -0,0 +1,48 @@
+/*
+ * cache_snapshot.h
+ *
+ * Binary snapshot of cached messages
+ */
+
+#ifndef CACHE_SNAPSHOT_H_
+#define CACHE_SNAPSHOT_H_
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+#include "buffered_message.h"
+
+// Format of snapshot: magic, version, then records of (key length, key, message length, message).
+// Lengths are 32 and 64 bit numbers in native byte order
+
+// Writes snapshot to temporary file and replaces file at <path> with it in commit()
+struct snapshot_writer {
+    explicit snapshot_writer(std::string const &path);
+
+    snapshot_writer(snapshot_writer const &other) = delete;
+    snapshot_writer &operator=(snapshot_writer const &other) = delete;
+
+    void write(std::string const &key, cached_message const &message);
+    void commit();
+
+private:
+    std::string path, tmp_path;
+    std::ofstream out;
+};
+
+// Reads snapshot record by record
+struct snapshot_reader {
+    explicit snapshot_reader(std::string const &path);
+
+    snapshot_reader(snapshot_reader const &other) = delete;
+    snapshot_reader &operator=(snapshot_reader const &other) = delete;
+
+    // Read next record. Returns false if there are no more records
+    bool next(std::string &key, cached_message &message);
+
+private:
+    std::ifstream in;
+};
+
+#endif /* CACHE_SNAPSHOT_H_ */
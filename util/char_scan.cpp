@@ -0,0 +1,156 @@
+#include "char_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHAR_SCAN_X86
+#endif
+
+namespace {
+    struct scan_kernels {
+        size_t (*find_either)(char const *data, size_t length, char a, char b);
+        void (*lower)(char *data, size_t length);
+        char const *name;
+    };
+
+    size_t find_either_scalar(char const *data, size_t length, char a, char b) {
+        for (size_t i = 0; i < length; i++) {
+            if (data[i] == a || data[i] == b) {
+                return i;
+            }
+        }
+        return length;
+    }
+
+    void lower_scalar(char *data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            if (data[i] >= 'A' && data[i] <= 'Z') {
+                data[i] += 'a' - 'A';
+            }
+        }
+    }
+
+#ifdef CHAR_SCAN_X86
+    __attribute__((target("sse2")))
+    size_t find_either_sse2(char const *data, size_t length, char a, char b) {
+        __m128i first = _mm_set1_epi8(a);
+        __m128i second = _mm_set1_epi8(b);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, first), _mm_cmpeq_epi8(chunk, second)));
+            if (mask != 0) {
+                return i + __builtin_ctz((unsigned) mask);
+            }
+        }
+        return i + find_either_scalar(data + i, length - i, a, b);
+    }
+
+    __attribute__((target("sse2")))
+    void lower_sse2(char *data, size_t length) {
+        // Bytes above 0x7f are negative, so they are never between 'A' and 'Z'
+        __m128i before_a = _mm_set1_epi8('A' - 1);
+        __m128i after_z = _mm_set1_epi8('Z' + 1);
+        __m128i shift = _mm_set1_epi8('a' - 'A');
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, before_a), _mm_cmplt_epi8(chunk, after_z));
+            chunk = _mm_add_epi8(chunk, _mm_and_si128(upper, shift));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), chunk);
+        }
+        lower_scalar(data + i, length - i);
+    }
+
+    __attribute__((target("avx2")))
+    size_t find_either_avx2(char const *data, size_t length, char a, char b) {
+        __m256i first = _mm256_set1_epi8(a);
+        __m256i second = _mm256_set1_epi8(b);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+            int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, first),
+                                                            _mm256_cmpeq_epi8(chunk, second)));
+            if (mask != 0) {
+                return i + __builtin_ctz((unsigned) mask);
+            }
+        }
+        // Legacy SSE code after AVX with dirty upper halves of registers is very slow
+        _mm256_zeroupper();
+        return i + find_either_sse2(data + i, length - i, a, b);
+    }
+
+    __attribute__((target("avx2")))
+    void lower_avx2(char *data, size_t length) {
+        __m256i before_a = _mm256_set1_epi8('A' - 1);
+        __m256i after_z = _mm256_set1_epi8('Z' + 1);
+        __m256i shift = _mm256_set1_epi8('a' - 'A');
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+            __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, before_a), _mm256_cmpgt_epi8(after_z, chunk));
+            chunk = _mm256_add_epi8(chunk, _mm256_and_si256(upper, shift));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), chunk);
+        }
+        _mm256_zeroupper();
+        lower_sse2(data + i, length - i);
+    }
+#endif
+
+    scan_kernels select_kernels() {
+#ifdef CHAR_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {find_either_avx2, lower_avx2, "avx2"};
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return {find_either_sse2, lower_sse2, "sse2"};
+        }
+#endif
+        return {find_either_scalar, lower_scalar, "scalar"};
+    }
+
+    scan_kernels const &get_kernels() {
+        static scan_kernels const kernels = select_kernels();
+        return kernels;
+    }
+}
+
+size_t find_either(char const *data, size_t length, char a, char b) {
+    return get_kernels().find_either(data, length, a, b);
+}
+
+size_t find_char(std::string const &str, char c, size_t pos) {
+    if (pos >= str.length()) {
+        return std::string::npos;
+    }
+    size_t found = pos + find_either(str.data() + pos, str.length() - pos, c, c);
+    return found == str.length() ? std::string::npos : found;
+}
+
+size_t find_line_end(std::string const &str, size_t pos) {
+    if (pos >= str.length()) {
+        return std::string::npos;
+    }
+    size_t found = pos + find_either(str.data() + pos, str.length() - pos, '\r', '\n');
+    return found == str.length() ? std::string::npos : found;
+}
+
+size_t find_header_end(std::string const &str) {
+    for (size_t pos = find_char(str, '\n'); pos != std::string::npos; pos = find_char(str, '\n', pos + 1)) {
+        if (pos + 1 < str.length() && str[pos + 1] == '\n') {
+            return pos + 2;
+        }
+        if (pos + 2 < str.length() && str[pos + 1] == '\r' && str[pos + 2] == '\n') {
+            return pos + 3;
+        }
+    }
+    return std::string::npos;
+}
+
+void lower_ascii(char *data, size_t length) {
+    get_kernels().lower(data, length);
+}
+
+char const *get_scan_kernels_name() {
+    return get_kernels().name;
+}
@@ -0,0 +1,35 @@
+/*
+ * char_scan.h
+ *
+ * Vectorized search of delimiters and case folding used by header parsing
+ */
+
+#ifndef CHAR_SCAN_H_
+#define CHAR_SCAN_H_
+
+#include <cstddef>
+#include <string>
+
+// Kernels process 32 (AVX2) or 16 (SSE2) bytes at a time. The best one that is supported by CPU
+// is selected at runtime, other platforms use scalar loops
+
+// Position of the first byte that is equal to <a> or <b>, <length> if there's no such byte
+size_t find_either(char const *data, size_t length, char a, char b);
+
+// Position of <c> in <str> starting from <pos>, std::string::npos if there's no such byte
+size_t find_char(std::string const &str, char c, size_t pos = 0);
+
+// Position of the first '\r' or '\n' in <str> starting from <pos>, std::string::npos if there's no such byte
+size_t find_line_end(std::string const &str, size_t pos = 0);
+
+// Position right after the empty line that ends HTTP header in <str>, std::string::npos if it isn't read yet.
+// Lines end with "\r\n" or bare "\n"
+size_t find_header_end(std::string const &str);
+
+// Lowercase ASCII letters, other bytes aren't changed
+void lower_ascii(char *data, size_t length);
+
+// Name of selected kernels: "avx2", "sse2" or "scalar"
+char const *get_scan_kernels_name();
+
+#endif /* CHAR_SCAN_H_ */
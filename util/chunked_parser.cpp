@@ -0,0 +1,161 @@
+#include "chunked_parser.h"
+
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+
+namespace {
+    int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+}
+
+chunked_parser::chunked_parser() : state(SIZE), chunk_size(0), size_digits(0), trailer(""), trailers() { }
+
+size_t chunked_parser::feed(char const *data, size_t length) {
+    size_t pos = 0;
+    while (pos < length && state != FINISHED) {
+        char c = data[pos];
+        switch (state) {
+            case SIZE: {
+                int digit = hex_value(c);
+                if (digit >= 0) {
+                    if (chunk_size > (std::numeric_limits<size_t>::max() >> 4)) {
+                        throw annotated_exception("chunked", "chunk is too big");
+                    }
+                    chunk_size = chunk_size * 16 + digit;
+                    size_digits++;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    state = EXTENSION;
+                } else if (c == '\r') {
+                    state = SIZE_LF;
+                } else if (c == '\n') {
+                    end_of_size_line();
+                } else {
+                    throw annotated_exception("chunked", "bad size of chunk");
+                }
+                pos++;
+                break;
+            }
+            case EXTENSION:
+                if (c == '\r') {
+                    state = SIZE_LF;
+                } else if (c == '\n') {
+                    end_of_size_line();
+                }
+                pos++;
+                break;
+            case SIZE_LF:
+                if (c != '\n') {
+                    throw annotated_exception("chunked", "bad end of size line");
+                }
+                end_of_size_line();
+                pos++;
+                break;
+            case DATA: {
+                // Skip the whole available part of chunk at once
+                size_t skipped = std::min(chunk_size, length - pos);
+                pos += skipped;
+                chunk_size -= skipped;
+                if (chunk_size == 0) {
+                    state = DATA_CR;
+                }
+                break;
+            }
+            case DATA_CR:
+                if (c == '\r') {
+                    state = DATA_LF;
+                } else if (c == '\n') {
+                    state = SIZE;
+                } else {
+                    throw annotated_exception("chunked", "bad end of chunk");
+                }
+                pos++;
+                break;
+            case DATA_LF:
+                if (c != '\n') {
+                    throw annotated_exception("chunked", "bad end of chunk");
+                }
+                state = SIZE;
+                pos++;
+                break;
+            case TRAILER:
+                if (c == '\r') {
+                    state = TRAILER_LF;
+                } else if (c == '\n') {
+                    end_of_trailer_line();
+                } else {
+                    if (trailer.length() >= MAX_TRAILER_LENGTH) {
+                        throw annotated_exception("chunked", "trailer is too long");
+                    }
+                    trailer += c;
+                }
+                pos++;
+                break;
+            case TRAILER_LF:
+                if (c != '\n') {
+                    throw annotated_exception("chunked", "bad end of trailer");
+                }
+                end_of_trailer_line();
+                pos++;
+                break;
+            case FINISHED:
+                break;
+        }
+    }
+    return pos;
+}
+
+void chunked_parser::end_of_size_line() {
+    if (size_digits == 0) {
+        throw annotated_exception("chunked", "size of chunk is missing");
+    }
+    size_digits = 0;
+    // Last chunk has zero size and is followed by trailer
+    state = (chunk_size == 0) ? TRAILER : DATA;
+}
+
+void chunked_parser::end_of_trailer_line() {
+    if (trailer.empty()) {
+        state = FINISHED;
+        return;
+    }
+    trailers.push_back(header_property(trailer));
+    trailer.clear();
+    state = TRAILER;
+}
+
+bool chunked_parser::is_finished() const {
+    return state == FINISHED;
+}
+
+std::vector<header_property> const &chunked_parser::get_trailers() const {
+    return trailers;
+}
+
+void swap(chunked_parser &first, chunked_parser &second) {
+    using std::swap;
+    swap(first.state, second.state);
+    swap(first.chunk_size, second.chunk_size);
+    swap(first.size_digits, second.size_digits);
+    first.trailer.swap(second.trailer);
+    first.trailers.swap(second.trailers);
+}
+
+std::string make_chunk(std::string const &data) {
+    char size[24];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    std::string chunk = size;
+    chunk += data;
+    chunk += "\r\n";
+    return chunk;
+}
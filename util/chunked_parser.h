@@ -0,0 +1,56 @@
+/*
+ * chunked_parser.h
+ *
+ * Incremental parser of HTTP chunked transfer-encoding
+ */
+
+#ifndef CHUNKED_PARSER_H_
+#define CHUNKED_PARSER_H_
+
+#include <string>
+#include <vector>
+
+#include "header_parser.h"
+
+// Follows chunked body through any number of reads and finds the exact end of message.
+// Body isn't decoded, so it can be forwarded and cached as is. Trailer fields are saved
+struct chunked_parser {
+    chunked_parser();
+
+    // Parse next part of body. Returns number of bytes that belong to the message.
+    // It's less than <length> only if message ended inside of this part
+    size_t feed(char const *data, size_t length);
+
+    bool is_finished() const;
+    std::vector<header_property> const &get_trailers() const;
+
+    friend void swap(chunked_parser &first, chunked_parser &second);
+private:
+    enum parser_state {
+        SIZE,           // Hex size of chunk
+        EXTENSION,      // Chunk extension after ';', ignored
+        SIZE_LF,        // '\n' after size line
+        DATA,           // Data of chunk
+        DATA_CR,        // '\r' after data
+        DATA_LF,        // '\n' after data
+        TRAILER,        // Trailer field or empty line
+        TRAILER_LF,     // '\n' after trailer field
+        FINISHED
+    };
+
+    static const size_t MAX_TRAILER_LENGTH = 8 * 1024;
+
+    void end_of_size_line();
+    void end_of_trailer_line();
+
+    parser_state state;
+    size_t chunk_size;
+    size_t size_digits;
+    std::string trailer;
+    std::vector<header_property> trailers;
+};
+
+// Encode data as one chunk. Empty data gives the last chunk
+std::string make_chunk(std::string const &data);
+
+#endif /* CHUNKED_PARSER_H_ */
@@ -0,0 +1,199 @@
+#include "compressor.h"
+
+#include <cstring>
+#include <cstdlib>
+
+namespace {
+    // Supported encodings in order of preference
+    char const *const ENCODINGS[] = {
+#ifdef HAVE_BROTLI
+            "br",
+#endif
+#ifdef HAVE_ZLIB
+            "gzip",
+#endif
+            nullptr
+    };
+
+    timespec get_cpu_time() {
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return time;
+    }
+
+    // Is coding allowed by Accept-Encoding: mentioned and its q isn't 0
+    bool is_accepted(std::string const &accept_encoding, std::string const &coding) {
+        size_t begin = 0;
+        while (begin <= accept_encoding.size()) {
+            size_t end = std::min(accept_encoding.find(',', begin), accept_encoding.size());
+            std::string item = accept_encoding.substr(begin, end - begin);
+            begin = end + 1;
+
+            size_t semicolon = item.find(';');
+            if (trim(item.substr(0, semicolon)).compare(coding) != 0) {
+                continue;
+            }
+            if (semicolon == std::string::npos) {
+                return true;
+            }
+            size_t q = item.find("q=", semicolon);
+            return q == std::string::npos || strtod(item.c_str() + q + 2, nullptr) > 0;
+        }
+        return false;
+    }
+}
+
+body_compressor::body_compressor(std::string const &encoding) : encoding(encoding), input_length(0),
+                                                                output_length(0), cpu_time{0, 0} {
+#ifdef HAVE_BROTLI
+    brotli = nullptr;
+#endif
+#ifdef HAVE_ZLIB
+    memset(&gzip, 0, sizeof(gzip));
+    if (encoding.compare("gzip") == 0) {
+        // 16 in window bits means gzip wrapper instead of zlib one
+        if (deflateInit2(&gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw annotated_exception("compressor", "can't initialize gzip");
+        }
+        return;
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (encoding.compare("br") == 0) {
+        brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        if (brotli == nullptr) {
+            throw annotated_exception("compressor", "can't initialize brotli");
+        }
+        // Fast level, compression happens while client waits
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY, 5);
+        return;
+    }
+#endif
+    throw annotated_exception("compressor", "unsupported encoding " + encoding);
+}
+
+body_compressor::~body_compressor() {
+#ifdef HAVE_ZLIB
+    if (encoding.compare("gzip") == 0) {
+        deflateEnd(&gzip);
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (brotli != nullptr) {
+        BrotliEncoderDestroyInstance(brotli);
+    }
+#endif
+}
+
+std::string body_compressor::feed(std::string const &data, bool finish) {
+    timespec start = get_cpu_time();
+    std::string res;
+    char buffer[OUTPUT_BUFFER];
+
+#ifdef HAVE_ZLIB
+    if (encoding.compare("gzip") == 0) {
+        gzip.next_in = (Bytef *) data.data();
+        gzip.avail_in = (uInt) data.size();
+        int code;
+        do {
+            gzip.next_out = (Bytef *) buffer;
+            gzip.avail_out = sizeof(buffer);
+            code = deflate(&gzip, finish ? Z_FINISH : Z_NO_FLUSH);
+            if (code == Z_STREAM_ERROR) {
+                throw annotated_exception("compressor", "gzip failed");
+            }
+            res.append(buffer, sizeof(buffer) - gzip.avail_out);
+        } while (gzip.avail_out == 0 || (finish && code != Z_STREAM_END));
+    }
+#endif
+#ifdef HAVE_BROTLI
+    if (brotli != nullptr) {
+        size_t available_in = data.size();
+        uint8_t const *next_in = (uint8_t const *) data.data();
+        BrotliEncoderOperation operation = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        while (available_in > 0 || BrotliEncoderHasMoreOutput(brotli) ||
+               (finish && !BrotliEncoderIsFinished(brotli))) {
+            size_t available_out = sizeof(buffer);
+            uint8_t *next_out = (uint8_t *) buffer;
+            if (!BrotliEncoderCompressStream(brotli, operation, &available_in, &next_in,
+                                             &available_out, &next_out, nullptr)) {
+                throw annotated_exception("compressor", "brotli failed");
+            }
+            res.append(buffer, sizeof(buffer) - available_out);
+        }
+    }
+#endif
+
+    timespec end = get_cpu_time();
+    cpu_time.tv_sec += end.tv_sec - start.tv_sec;
+    cpu_time.tv_nsec += end.tv_nsec - start.tv_nsec;
+    input_length += data.size();
+    output_length += res.size();
+    return res;
+}
+
+std::string const &body_compressor::get_encoding() const {
+    return encoding;
+}
+
+size_t body_compressor::get_input_length() const {
+    return input_length;
+}
+
+size_t body_compressor::get_output_length() const {
+    return output_length;
+}
+
+double body_compressor::get_cpu_seconds() const {
+    return cpu_time.tv_sec + cpu_time.tv_nsec / 1e9;
+}
+
+std::string body_compressor::choose_encoding(std::string const &accept_encoding) {
+    std::string value = to_lower(accept_encoding);
+    for (size_t i = 0; ENCODINGS[i] != nullptr; i++) {
+        if (is_accepted(value, ENCODINGS[i])) {
+            return ENCODINGS[i];
+        }
+    }
+    return "";
+}
+
+bool body_compressor::is_compressible(response_header const &header) {
+    if (header.get_request_line().get_code() != 200 || header.has_property(header_name::CONTENT_ENCODING) ||
+        header.has_property(header_name::TRANSFER_ENCODING) || !header.has_property(header_name::CONTENT_LENGTH)) {
+        return false;
+    }
+    if (strtoull(header.get_property(header_name::CONTENT_LENGTH).c_str(), nullptr, 10) < MIN_LENGTH) {
+        return false;
+    }
+    if (to_lower(header.get_property(header_name::CACHE_CONTROL)).find("no-transform") != std::string::npos) {
+        return false;
+    }
+
+    std::string type = to_lower(header.get_property(header_name::CONTENT_TYPE));
+    return type.compare(0, 5, "text/") == 0 ||
+           type.find("json") != std::string::npos ||
+           type.find("javascript") != std::string::npos ||
+           type.find("xml") != std::string::npos;
+}
+
+void body_compressor::add_vary(response_header &header) {
+    std::string vary = header.get_property(header_name::VARY);
+    if (to_lower(vary).find("accept-encoding") == std::string::npos) {
+        header.set_property(header_name::VARY, vary.empty() ? "Accept-Encoding" : vary + ", Accept-Encoding");
+    }
+}
+
+response_header body_compressor::make_header(response_header header, std::string const &encoding) {
+    header.erase_property(header_name::CONTENT_LENGTH);
+    header.set_property(header_name::TRANSFER_ENCODING, "chunked");
+    header.set_property(header_name::CONTENT_ENCODING, encoding);
+    add_vary(header);
+
+    // Compressed body differs from original one byte by byte, so validator becomes weak
+    std::string etag = header.get_property(header_name::ETAG);
+    if (!etag.empty() && etag.compare(0, 2, "W/") != 0) {
+        header.set_property(header_name::ETAG, "W/" + etag);
+    }
+    return header;
+}
@@ -0,0 +1,69 @@
+/*
+ * compressor.h
+ *
+ * Streaming compression of response bodies
+ */
+
+#ifndef COMPRESSOR_H_
+#define COMPRESSOR_H_
+
+#include <string>
+#include <ctime>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "header_parser.h"
+
+// Compressor of body with "gzip" or "br" content coding. Compressors that weren't found
+// at build time are not available
+struct body_compressor {
+    explicit body_compressor(std::string const &encoding);
+
+    body_compressor(body_compressor const &other) = delete;
+    body_compressor &operator=(body_compressor const &other) = delete;
+
+    ~body_compressor();
+
+    // Compress next part of body. If <finish>, the end of compressed stream is returned too
+    std::string feed(std::string const &data, bool finish);
+
+    std::string const &get_encoding() const;
+    size_t get_input_length() const;
+    size_t get_output_length() const;
+    // CPU time spent on compression
+    double get_cpu_seconds() const;
+
+    // The best available encoding allowed by Accept-Encoding, empty if there is none
+    static std::string choose_encoding(std::string const &accept_encoding);
+
+    // Response isn't compressed yet, has known length and compressible type
+    static bool is_compressible(response_header const &header);
+
+    // Mark response as varying on Accept-Encoding
+    static void add_vary(response_header &header);
+
+    // Header of compressed response: Content-Length is replaced with chunked transfer coding
+    static response_header make_header(response_header header, std::string const &encoding);
+
+private:
+    static const size_t MIN_LENGTH = 256;       // Smaller bodies don't get shorter
+    static const size_t OUTPUT_BUFFER = 16 * 1024;
+
+    std::string encoding;
+    size_t input_length, output_length;
+    timespec cpu_time;
+
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+#endif
+#ifdef HAVE_BROTLI
+    BrotliEncoderState *brotli;
+#endif
+};
+
+#endif /* COMPRESSOR_H_ */
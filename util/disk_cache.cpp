@@ -0,0 +1,182 @@
+#include "disk_cache.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <vector>
+#include <algorithm>
+
+disk_cache::disk_cache() : directory(""), max_segments(0), segments(), index() { }
+
+disk_cache::disk_cache(std::string const &directory, size_t max_size) :
+        directory(directory), max_segments(std::max(max_size / SEGMENT_SIZE, (size_t) 1)), segments(), index() {
+    if (directory.empty()) {
+        return;
+    }
+    if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+        int err = errno;
+        throw annotated_exception("disk cache", err);
+    }
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        int err = errno;
+        throw annotated_exception("disk cache", err);
+    }
+    std::vector<unsigned> ids;
+    while (dirent *entry = readdir(dir)) {
+        unsigned id;
+        char tail;
+        if (sscanf(entry->d_name, "segment_%u%c", &id, &tail) == 1) {
+            ids.push_back(id);
+        }
+    }
+    closedir(dir);
+
+    // Newer segments override older ones
+    std::sort(ids.begin(), ids.end());
+    for (auto it = ids.begin(); it != ids.end(); it++) {
+        load_segment(*it, open_segment(*it));
+    }
+    while (segments.size() > max_segments) {
+        drop_oldest_segment();
+    }
+    log("disk cache", std::to_string(index.size()) + " messages loaded from " + directory);
+}
+
+bool disk_cache::is_enabled() const {
+    return !directory.empty();
+}
+
+void disk_cache::insert(std::string const &key, cached_message const &message) {
+    uint64_t data_length = 0;
+    for (auto it = message.begin(); it != message.end(); it++) {
+        data_length += it->length();
+    }
+    location loc;
+    if (append(key, &message, data_length, loc)) {
+        index[key] = loc;
+    }
+}
+
+bool disk_cache::has(std::string const &key) const {
+    return index.find(key) != index.end();
+}
+
+cached_message disk_cache::find(std::string const &key) const {
+    index_t::const_iterator it = index.find(key);
+    if (it == index.end()) {
+        throw annotated_exception("disk cache", "element not found");
+    }
+    location const &loc = it->second;
+    char const *data = segments.at(loc.segment).map.get() + loc.offset;
+    return cached_message{std::string(data, loc.length)};
+}
+
+void disk_cache::erase(std::string const &key) {
+    index_t::iterator it = index.find(key);
+    if (it == index.end()) {
+        return;
+    }
+    index.erase(it);
+    // Remember about erasing after restart
+    location loc;
+    append(key, nullptr, TOMBSTONE, loc);
+}
+
+size_t disk_cache::size() const {
+    return index.size();
+}
+
+size_t disk_cache::record_size(size_t key_length, uint64_t data_length) {
+    size_t size = sizeof(record_header) + key_length + (data_length == TOMBSTONE ? 0 : data_length);
+    return (size + 7) & ~(size_t) 7;
+}
+
+std::string disk_cache::segment_path(unsigned id) const {
+    char name[32];
+    snprintf(name, sizeof name, "segment_%06u", id);
+    return directory + "/" + name;
+}
+
+disk_cache::segment &disk_cache::open_segment(unsigned id) {
+    file_descriptor fd(open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+    // Reserve disk space beforehand: writing to a mapped hole on a full disk would raise SIGBUS
+    int err = posix_fallocate(fd.get(), 0, SEGMENT_SIZE);
+    if (err != 0) {
+        throw annotated_exception("disk cache", err);
+    }
+    memory_map map(fd, SEGMENT_SIZE, true);
+    segment seg{std::move(fd), std::move(map), 0};
+    return segments.insert(std::make_pair(id, std::move(seg))).first->second;
+}
+
+void disk_cache::load_segment(unsigned id, segment &seg) {
+    char const *data = seg.map.get();
+    while (seg.used + sizeof(record_header) <= SEGMENT_SIZE) {
+        record_header header;
+        memcpy(&header, data + seg.used, sizeof header);
+        size_t size = record_size(header.key_length, header.data_length);
+        if (header.magic != RECORD_MAGIC || seg.used + size > SEGMENT_SIZE) {
+            break;
+        }
+        std::string key(data + seg.used + sizeof header, header.key_length);
+        if (header.data_length == TOMBSTONE) {
+            index.erase(key);
+        } else {
+            index[key] = {id, seg.used + sizeof header + header.key_length, header.data_length};
+        }
+        seg.used += size;
+    }
+}
+
+void disk_cache::drop_oldest_segment() {
+    segments_t::iterator oldest = segments.begin();
+    unsigned id = oldest->first;
+    for (index_t::iterator it = index.begin(); it != index.end();) {
+        if (it->second.segment == id) {
+            it = index.erase(it);
+        } else {
+            it++;
+        }
+    }
+    segments.erase(oldest);
+    unlink(segment_path(id).c_str());
+}
+
+bool disk_cache::append(std::string const &key, cached_message const *message, uint64_t data_length,
+                        location &loc) {
+    size_t size = record_size(key.length(), data_length);
+    if (size > SEGMENT_SIZE) {
+        return false;
+    }
+    if (segments.empty() || segments.rbegin()->second.used + size > SEGMENT_SIZE) {
+        unsigned id = segments.empty() ? 0 : segments.rbegin()->first + 1;
+        open_segment(id);
+        while (segments.size() > max_segments) {
+            drop_oldest_segment();
+        }
+    }
+    unsigned id = segments.rbegin()->first;
+    segment &seg = segments.rbegin()->second;
+    char *record = seg.map.get() + seg.used;
+
+    size_t offset = sizeof(record_header);
+    memcpy(record + offset, key.data(), key.length());
+    offset += key.length();
+    loc = {id, seg.used + offset, (size_t) (data_length == TOMBSTONE ? 0 : data_length)};
+    if (message != nullptr) {
+        for (auto it = message->begin(); it != message->end(); it++) {
+            memcpy(record + offset, it->data(), it->length());
+            offset += it->length();
+        }
+    }
+
+    record_header header{0, (uint32_t) key.length(), data_length};
+    memcpy(record, &header, sizeof header);
+    uint32_t magic = RECORD_MAGIC;
+    memcpy(record, &magic, sizeof magic);
+    seg.used += size;
+    return true;
+}
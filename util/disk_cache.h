@@ -0,0 +1,81 @@
+/*
+ * disk_cache.h
+ *
+ * Persistent tier of response cache
+ */
+
+#ifndef DISK_CACHE_H_
+#define DISK_CACHE_H_
+
+#include <string>
+#include <map>
+#include <cstdint>
+
+#include "wraps.h"
+#include "buffered_message.h"
+
+// Cache of messages on disk. Messages are appended to memory-mapped segment files of fixed size,
+// index of messages is kept in memory and is rebuilt from segments at startup.
+// When size limit is reached, the oldest segment is deleted with all its messages
+struct disk_cache {
+    // Disabled cache
+    disk_cache();
+    // Cache in <directory> that takes not more than <max_size> bytes. Empty directory disables cache
+    disk_cache(std::string const &directory, size_t max_size);
+
+    disk_cache(disk_cache const &other) = delete;
+    disk_cache &operator=(disk_cache const &other) = delete;
+
+    bool is_enabled() const;
+
+    void insert(std::string const &key, cached_message const &message);
+    bool has(std::string const &key) const;
+    cached_message find(std::string const &key) const;
+    void erase(std::string const &key);
+
+    size_t size() const;
+private:
+    static const size_t SEGMENT_SIZE = 64 * 1024 * 1024;
+    static const uint32_t RECORD_MAGIC = 0x58435250;        // "PRCX"
+    static const uint64_t TOMBSTONE = ~(uint64_t) 0;        // Data length of record about erased message
+
+    // Record is header, key and data, aligned to 8 bytes. Magic is written last,
+    // so record that wasn't written completely is ignored
+    struct record_header {
+        uint32_t magic;
+        uint32_t key_length;
+        uint64_t data_length;
+    };
+
+    struct segment {
+        file_descriptor fd;
+        memory_map map;
+        size_t used;
+    };
+
+    struct location {
+        unsigned segment;
+        size_t offset;          // Offset of data in segment
+        size_t length;
+    };
+
+    using segments_t = std::map<unsigned, segment>;
+    using index_t = std::map<std::string, location>;
+
+    static size_t record_size(size_t key_length, uint64_t data_length);
+
+    std::string segment_path(unsigned id) const;
+    segment &open_segment(unsigned id);
+    void load_segment(unsigned id, segment &seg);
+    void drop_oldest_segment();
+
+    // Write record to the newest segment. Returns false if record is too big
+    bool append(std::string const &key, cached_message const *message, uint64_t data_length, location &loc);
+
+    std::string directory;
+    size_t max_segments;
+    segments_t segments;
+    index_t index;
+};
+
+#endif /* DISK_CACHE_H_ */
@@ -0,0 +1,251 @@
+/*
+ * event_handler.h
+ *
+ * Callable wrap for handlers of events and continuations
+ */
+
+#ifndef EVENT_HANDLER_H_
+#define EVENT_HANDLER_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Signature, size_t INLINE_SIZE = 96>
+struct event_handler;
+
+// Analogue of std::function<void(Args...)>. Callables that are not bigger than INLINE_SIZE are stored
+// inside of handler, so creation, move and call of such handler never allocate memory.
+// Bigger callables are stored in heap
+template<typename... Args, size_t INLINE_SIZE>
+struct event_handler<void(Args...), INLINE_SIZE> {
+    event_handler();
+    event_handler(std::nullptr_t);
+
+    // Accepts only callables, so handler isn't ambiguous with arguments of other overloads
+    template<typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, event_handler>::value>::type,
+            typename = decltype(std::declval<typename std::decay<F>::type &>()(std::declval<Args>()...))>
+    event_handler(F &&func);
+
+    event_handler(event_handler const &other);
+    event_handler(event_handler &&other);
+    event_handler &operator=(event_handler other);
+
+    ~event_handler();
+
+    void operator()(Args... args) const;
+    explicit operator bool() const;
+
+    template<typename S, size_t N>
+    friend void swap(event_handler<S, N> &first, event_handler<S, N> &second);
+private:
+    // Table of functions that know the type of stored callable
+    struct operations {
+        void (*call)(void *storage, Args... args);
+        void (*copy)(void const *from, void *to);
+        void (*move)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    template<typename F>
+    struct inline_operations {
+        static void call(void *storage, Args... args);
+        static void copy(void const *from, void *to);
+        static void move(void *from, void *to);
+        static void destroy(void *storage);
+
+        static const operations table;
+    };
+
+    template<typename F>
+    struct heap_operations {
+        static void call(void *storage, Args... args);
+        static void copy(void const *from, void *to);
+        static void move(void *from, void *to);
+        static void destroy(void *storage);
+
+        static const operations table;
+    };
+
+    template<typename F>
+    struct fits_inline {
+        static const bool value = sizeof(F) <= INLINE_SIZE &&
+                                  alignof(std::max_align_t) % alignof(F) == 0 &&
+                                  std::is_nothrow_move_constructible<F>::value;
+    };
+
+    template<typename F>
+    void store(F &&func, std::true_type);
+    template<typename F>
+    void store(F &&func, std::false_type);
+
+    void reset();
+
+    operations const *ops;
+    mutable typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+};
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+const typename event_handler<void(Args...), INLINE_SIZE>::operations
+        event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::table = {
+        &event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::call,
+        &event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::copy,
+        &event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::move,
+        &event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::destroy
+};
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+const typename event_handler<void(Args...), INLINE_SIZE>::operations
+        event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::table = {
+        &event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::call,
+        &event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::copy,
+        &event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::move,
+        &event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::destroy
+};
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::call(void *storage, Args... args) {
+    (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::copy(void const *from, void *to) {
+    new(to) F(*static_cast<F const *>(from));
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::move(void *from, void *to) {
+    new(to) F(std::move(*static_cast<F *>(from)));
+    static_cast<F *>(from)->~F();
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::inline_operations<F>::destroy(void *storage) {
+    static_cast<F *>(storage)->~F();
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::call(void *storage, Args... args) {
+    (**static_cast<F **>(storage))(std::forward<Args>(args)...);
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::copy(void const *from, void *to) {
+    *static_cast<F **>(to) = new F(**static_cast<F *const *>(from));
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::move(void *from, void *to) {
+    *static_cast<F **>(to) = *static_cast<F **>(from);
+    *static_cast<F **>(from) = nullptr;
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::heap_operations<F>::destroy(void *storage) {
+    delete *static_cast<F **>(storage);
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::event_handler() : ops(nullptr) {
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::event_handler(std::nullptr_t) : ops(nullptr) {
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F, typename, typename>
+event_handler<void(Args...), INLINE_SIZE>::event_handler(F &&func) : ops(nullptr) {
+    using callable_t = typename std::decay<F>::type;
+    store(std::forward<F>(func), std::integral_constant<bool, fits_inline<callable_t>::value>());
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::store(F &&func, std::true_type) {
+    using callable_t = typename std::decay<F>::type;
+    new(&storage) callable_t(std::forward<F>(func));
+    ops = &inline_operations<callable_t>::table;
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+template<typename F>
+void event_handler<void(Args...), INLINE_SIZE>::store(F &&func, std::false_type) {
+    using callable_t = typename std::decay<F>::type;
+    *reinterpret_cast<callable_t **>(&storage) = new callable_t(std::forward<F>(func));
+    ops = &heap_operations<callable_t>::table;
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::event_handler(event_handler const &other) : ops(other.ops) {
+    if (ops != nullptr) {
+        ops->copy(&other.storage, &storage);
+    }
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::event_handler(event_handler &&other) : ops(other.ops) {
+    if (ops != nullptr) {
+        ops->move(&other.storage, &storage);
+        other.ops = nullptr;
+    }
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE> &event_handler<void(Args...), INLINE_SIZE>::operator=(
+        event_handler other) {
+    swap(*this, other);
+    return *this;
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::~event_handler() {
+    reset();
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+void event_handler<void(Args...), INLINE_SIZE>::reset() {
+    if (ops != nullptr) {
+        ops->destroy(&storage);
+        ops = nullptr;
+    }
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+void event_handler<void(Args...), INLINE_SIZE>::operator()(Args... args) const {
+    ops->call(&storage, std::forward<Args>(args)...);
+}
+
+template<typename... Args, size_t INLINE_SIZE>
+event_handler<void(Args...), INLINE_SIZE>::operator bool() const {
+    return ops != nullptr;
+}
+
+template<typename S, size_t N>
+void swap(event_handler<S, N> &first, event_handler<S, N> &second) {
+    event_handler<S, N> tmp(std::move(first));
+    if (second.ops != nullptr) {
+        second.ops->move(&second.storage, &first.storage);
+        first.ops = second.ops;
+        second.ops = nullptr;
+    }
+    if (tmp.ops != nullptr) {
+        tmp.ops->move(&tmp.storage, &second.storage);
+        second.ops = tmp.ops;
+        tmp.ops = nullptr;
+    }
+}
+
+#endif /* EVENT_HANDLER_H_ */
@@ -0,0 +1,51 @@
+#include "frequency_sketch.h"
+
+#include <functional>
+#include <algorithm>
+
+frequency_sketch::frequency_sketch(size_t capacity) : counters(), mask(0), additions(0),
+                                                      sample_size(10 * std::max(capacity, (size_t) 1)) {
+    size_t width = 1;
+    while (width < capacity) {
+        width <<= 1;
+    }
+    mask = width - 1;
+    counters.assign(DEPTH * width, 0);
+}
+
+void frequency_sketch::increment(std::string const &key) {
+    size_t hash = std::hash<std::string>()(key);
+    bool added = false;
+    for (size_t row = 0; row < DEPTH; row++) {
+        uint8_t &counter = counters[index(hash, row)];
+        if (counter < MAX_COUNT) {
+            counter++;
+            added = true;
+        }
+    }
+    if (added && ++additions == sample_size) {
+        age();
+    }
+}
+
+unsigned frequency_sketch::estimate(std::string const &key) const {
+    size_t hash = std::hash<std::string>()(key);
+    unsigned res = MAX_COUNT;
+    for (size_t row = 0; row < DEPTH; row++) {
+        res = std::min(res, (unsigned) counters[index(hash, row)]);
+    }
+    return res;
+}
+
+size_t frequency_sketch::index(size_t hash, size_t row) const {
+    // Double hashing: rows use different combinations of two halves of hash
+    size_t second = (hash >> 17 | hash << 15) * 0x9e3779b1u | 1;
+    return (row * (mask + 1)) + ((hash + row * second) & mask);
+}
+
+void frequency_sketch::age() {
+    for (auto it = counters.begin(); it != counters.end(); it++) {
+        *it >>= 1;
+    }
+    additions /= 2;
+}
@@ -0,0 +1,35 @@
+/*
+ * frequency_sketch.h
+ *
+ * Approximate counter of key frequencies for cache admission
+ */
+
+#ifndef FREQUENCY_SKETCH_H_
+#define FREQUENCY_SKETCH_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Count-min sketch with small saturating counters. To follow changes of popularity, all counters
+// are halved after every 10 * <capacity> increments, so old accesses are forgotten
+struct frequency_sketch {
+    // Sketch for cache of <capacity> elements
+    explicit frequency_sketch(size_t capacity);
+
+    void increment(std::string const &key);
+    unsigned estimate(std::string const &key) const;
+
+private:
+    static const size_t DEPTH = 4;
+    static const uint8_t MAX_COUNT = 15;
+
+    size_t index(size_t hash, size_t row) const;
+    void age();
+
+    std::vector<uint8_t> counters;      // DEPTH rows of width (mask + 1)
+    size_t mask;
+    size_t additions, sample_size;
+};
+
+#endif /* FREQUENCY_SKETCH_H_ */
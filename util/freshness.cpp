@@ -0,0 +1,120 @@
+#include "freshness.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+
+namespace {
+    const long UNKNOWN_AGE = LONG_MAX / 4;
+
+    // Value of "name=value" directive of Cache-Control, -1 if there is no such directive
+    long get_directive(std::string const &cache_control, std::string const &name) {
+        size_t pos = 0;
+        while ((pos = cache_control.find(name + "=", pos)) != std::string::npos) {
+            // Should be the whole name, not a suffix (E.G. "max-age" in "s-max-age")
+            if (pos == 0 || cache_control[pos - 1] == ' ' || cache_control[pos - 1] == ',') {
+                long value = strtol(cache_control.c_str() + pos + name.size() + 1, nullptr, 10);
+                return value < 0 ? 0 : value;
+            }
+            pos += name.size();
+        }
+        return -1;
+    }
+}
+
+freshness::freshness(response_header const &header, long default_while_revalidate, long default_if_error,
+                     time_t now) : age(UNKNOWN_AGE), lifetime(0), while_revalidate(0), if_error(0),
+                                   estimated_at(now) {
+    std::string cache_control = to_lower(header.get_property(header_name::CACHE_CONTROL));
+
+    time_t date = parse_http_date(header.get_property(header_name::DATE));
+    if (date != -1) {
+        age = std::max(0L, (long) (now - date));
+        age += std::max(0L, strtol(header.get_property(header_name::AGE).c_str(), nullptr, 10));
+    }
+
+    if (cache_control.find("no-cache") != std::string::npos) {
+        return;
+    }
+
+    long max_age = get_directive(cache_control, "s-maxage");
+    if (max_age == -1) {
+        max_age = get_directive(cache_control, "max-age");
+    }
+    if (max_age != -1) {
+        lifetime = max_age;
+    } else if (header.has_property(header_name::EXPIRES) && date != -1) {
+        time_t expires = parse_http_date(header.get_property(header_name::EXPIRES));
+        lifetime = std::max(0L, (long) (expires - date));
+    }
+
+    // Server forbids stale responses
+    if (cache_control.find("must-revalidate") != std::string::npos ||
+        cache_control.find("proxy-revalidate") != std::string::npos) {
+        return;
+    }
+
+    while_revalidate = get_directive(cache_control, "stale-while-revalidate");
+    if (while_revalidate == -1) {
+        while_revalidate = default_while_revalidate;
+    }
+    if_error = get_directive(cache_control, "stale-if-error");
+    if (if_error == -1) {
+        if_error = default_if_error;
+    }
+}
+
+bool freshness::is_fresh() const {
+    return age < lifetime;
+}
+
+bool freshness::can_revalidate_in_background() const {
+    return age < lifetime + while_revalidate;
+}
+
+bool freshness::can_serve_on_error() const {
+    return age < lifetime + if_error;
+}
+
+freshness freshness::at(time_t now) const {
+    freshness res(*this);
+    if (age != UNKNOWN_AGE) {
+        res.age += std::max(0L, (long) (now - estimated_at));
+    }
+    res.estimated_at = now;
+    return res;
+}
+
+time_t parse_http_date(std::string const &date) {
+    struct tm time;
+    memset(&time, 0, sizeof(time));
+    char const *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &time);
+    if (end == nullptr) {
+        return -1;
+    }
+    return timegm(&time);
+}
+
+cached_message merge_not_modified(cached_message const &cached, response_header const &not_modified) {
+    static char const *const FIELDS[] = {"date", "expires", "cache-control", "etag", "last-modified", "age"};
+
+    std::string message;
+    for (auto it = cached.begin(); it != cached.end(); it++) {
+        message += *it;
+    }
+    size_t header_end = message.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+        return cached;
+    }
+    header_end += 4;
+
+    response_header header(message.substr(0, header_end));
+    header.erase_property(header_name::AGE);       // Age of the old response doesn't matter anymore
+    for (char const *field : FIELDS) {
+        if (not_modified.has_property(field)) {
+            header.set_property(field, not_modified.get_property(field));
+        }
+    }
+    return {to_string(header), message.substr(header_end)};
+}
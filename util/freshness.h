@@ -0,0 +1,43 @@
+/*
+ * freshness.h
+ *
+ * Freshness of cached responses
+ */
+
+#ifndef FRESHNESS_H_
+#define FRESHNESS_H_
+
+#include <string>
+#include <ctime>
+
+#include "header_parser.h"
+#include "buffered_message.h"
+
+// How long cached response can be served. Based on Date, Age, Expires and Cache-Control
+// (max-age, s-maxage, stale-while-revalidate, stale-if-error). All times are in seconds
+struct freshness {
+    // Freshness of response at time <now>. Defaults are used when response has no stale-* directives
+    freshness(response_header const &header, long default_while_revalidate, long default_if_error, time_t now);
+
+    // Response can be served without validation
+    bool is_fresh() const;
+    // Stale response can be served while it's validated
+    bool can_revalidate_in_background() const;
+    // Stale response can be served if server fails
+    bool can_serve_on_error() const;
+
+    // Freshness of the same response at later time <now>
+    freshness at(time_t now) const;
+
+    long age, lifetime;
+    long while_revalidate, if_error;
+    time_t estimated_at;            // Time of <age>
+};
+
+// Parse date in format of RFC 1123 (E.G. "Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 if date is invalid
+time_t parse_http_date(std::string const &date);
+
+// Cached response with fields of header updated from "304 Not Modified" response
+cached_message merge_not_modified(cached_message const &cached, response_header const &not_modified);
+
+#endif /* FRESHNESS_H_ */
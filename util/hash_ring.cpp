@@ -0,0 +1,70 @@
+#include "hash_ring.h"
+
+#include <algorithm>
+#include <cmath>
+
+const double hash_ring::LOAD_FACTOR = 1.25;
+
+hash_ring::hash_ring() : points(), loads() { }
+
+hash_ring::hash_ring(std::vector<std::string> const &members) : points(), loads() {
+    for (size_t i = 0; i < members.size(); i++) {
+        for (size_t node = 0; node < VIRTUAL_NODES; node++) {
+            points.push_back({hash(members[i] + "#" + std::to_string(node)), i});
+        }
+        loads.push_back(std::make_shared<size_t>(0));
+    }
+    std::sort(points.begin(), points.end());
+}
+
+bool hash_ring::empty() const {
+    return loads.empty();
+}
+
+size_t hash_ring::size() const {
+    return loads.size();
+}
+
+size_t hash_ring::get_owner(std::string const &key) const {
+    auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(hash(key), (size_t) 0));
+    return it == points.end() ? points.front().second : it->second;
+}
+
+size_t hash_ring::get_member(std::string const &key) const {
+    size_t total = 0;
+    for (auto const &load : loads) {
+        total += *load;
+    }
+    // Capacity counts the new request too, so somebody always fits
+    size_t capacity = (size_t) std::ceil(LOAD_FACTOR * (double) (total + 1) / (double) loads.size());
+
+    size_t start = std::lower_bound(points.begin(), points.end(), std::make_pair(hash(key), (size_t) 0)) -
+                   points.begin();
+    for (size_t i = 0; i < points.size(); i++) {
+        size_t member = points[(start + i) % points.size()].second;
+        if (*loads[member] < capacity) {
+            return member;
+        }
+    }
+    return get_owner(key);
+}
+
+load_lease hash_ring::acquire(size_t member) {
+    return load_lease(loads[member]);
+}
+
+size_t hash_ring::get_load(size_t member) const {
+    return *loads[member];
+}
+
+uint64_t hash_ring::hash(std::string const &str) {
+    // FNV-1a with finalizer of splitmix64, so close names spread over whole ring. It doesn't depend on
+    // standard library, so all members of cluster agree on owners
+    uint64_t res = 14695981039346656037ull;
+    for (char c : str) {
+        res = (res ^ (uint8_t) c) * 1099511628211ull;
+    }
+    res = (res ^ (res >> 30)) * 0xbf58476d1ce4e5b9ull;
+    res = (res ^ (res >> 27)) * 0x94d049bb133111ebull;
+    return res ^ (res >> 31);
+}
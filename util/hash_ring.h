@@ -0,0 +1,47 @@
+/*
+ * hash_ring.h
+ *
+ * Consistent hashing of cache keys over members of cluster
+ */
+
+#ifndef HASH_RING_H_
+#define HASH_RING_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cstdint>
+
+#include "load_lease.h"
+
+// Ring of virtual nodes of members. Key belongs to the first member clockwise from its hash, so adding
+// or removing member moves only keys of its own virtual nodes. Load is bounded: member that has more than
+// LOAD_FACTOR times average load is skipped for the next one on the ring
+struct hash_ring {
+    hash_ring();
+    // Members are identified by names, so nodes that know same names build same ring in any order
+    explicit hash_ring(std::vector<std::string> const &members);
+
+    bool empty() const;
+    size_t size() const;
+
+    // Member that owns key, whatever its load is
+    size_t get_owner(std::string const &key) const;
+    // Owner of key among members that aren't overloaded
+    size_t get_member(std::string const &key) const;
+
+    load_lease acquire(size_t member);
+    size_t get_load(size_t member) const;
+
+private:
+    static const size_t VIRTUAL_NODES = 160;
+    static const double LOAD_FACTOR;
+
+    static uint64_t hash(std::string const &str);
+
+    std::vector<std::pair<uint64_t, size_t>> points;    // Sorted hashes of virtual nodes with their members
+    std::vector<std::shared_ptr<size_t>> loads;
+};
+
+#endif /* HASH_RING_H_ */
@@ -0,0 +1,61 @@
+#include "header_name.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+    std::vector<std::string> const &get_names() {
+        static std::vector<std::string> const names = {
+                "host", "connection", "proxy-connection", "keep-alive", "content-length", "transfer-encoding",
+                "content-type", "content-encoding", "content-range", "cache-control", "pragma", "expires", "etag",
+                "last-modified", "date", "age", "vary", "range", "if-range", "if-none-match", "if-modified-since",
+                "accept-encoding", "expect", "te", "trailer", "upgrade", "user-agent", "accept", "cookie",
+                "set-cookie", "location", "authorization", "server", "via"
+        };
+        return names;
+    }
+}
+
+size_t header_name::hash(char const *name, size_t length) {
+    // FNV-1a
+    uint32_t res = SEED;
+    for (size_t i = 0; i < length; i++) {
+        res = (res ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return (res >> 16) & (TABLE_SIZE - 1);
+}
+
+header_name::id header_name::find(char const *name, size_t length) {
+    // Slots of table keep ID + 1, 0 is empty slot. Collisions of names that may be added later are
+    // resolved by probing, so lookup stays correct when seed isn't perfect anymore
+    static std::vector<uint8_t> const slots = []() {
+        std::vector<uint8_t> res(TABLE_SIZE, 0);
+        std::vector<std::string> const &names = get_names();
+        for (size_t i = 0; i < names.size(); i++) {
+            size_t slot = hash(names[i].data(), names[i].length());
+            while (res[slot] != 0) {
+                slot = (slot + 1) & (TABLE_SIZE - 1);
+            }
+            res[slot] = (uint8_t) (i + 1);
+        }
+        return res;
+    }();
+
+    std::vector<std::string> const &names = get_names();
+    for (size_t slot = hash(name, length); slots[slot] != 0; slot = (slot + 1) & (TABLE_SIZE - 1)) {
+        std::string const &candidate = names[slots[slot] - 1];
+        if (candidate.length() == length && memcmp(candidate.data(), name, length) == 0) {
+            return (id) (slots[slot] - 1);
+        }
+    }
+    return UNKNOWN;
+}
+
+header_name::id header_name::find(std::string const &name) {
+    return find(name.data(), name.length());
+}
+
+std::string const &header_name::get(id name) {
+    return get_names()[name];
+}
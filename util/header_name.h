@@ -0,0 +1,40 @@
+/*
+ * header_name.h
+ *
+ * IDs of header field names that proxy works with
+ */
+
+#ifndef HEADER_NAME_H_
+#define HEADER_NAME_H_
+
+#include <cstddef>
+#include <string>
+
+// Known lowercase names of header fields. Their IDs are known at compile time, so headers keep
+// these fields in a table by ID. Names are found by hash that has no collisions for them
+struct header_name {
+    enum id {
+        HOST, CONNECTION, PROXY_CONNECTION, KEEP_ALIVE, CONTENT_LENGTH, TRANSFER_ENCODING,
+        CONTENT_TYPE, CONTENT_ENCODING, CONTENT_RANGE, CACHE_CONTROL, PRAGMA, EXPIRES, ETAG,
+        LAST_MODIFIED, DATE, AGE, VARY, RANGE, IF_RANGE, IF_NONE_MATCH, IF_MODIFIED_SINCE,
+        ACCEPT_ENCODING, EXPECT, TE, TRAILER, UPGRADE, USER_AGENT, ACCEPT, COOKIE, SET_COOKIE,
+        LOCATION, AUTHORIZATION, SERVER, VIA,
+        COUNT,                  // Number of known names
+        UNKNOWN = COUNT
+    };
+
+    // ID of lowercase name, UNKNOWN if it isn't known
+    static id find(char const *name, size_t length);
+    static id find(std::string const &name);
+
+    // Lowercase name with ID
+    static std::string const &get(id name);
+
+private:
+    static const size_t TABLE_SIZE = 128;
+    static const unsigned SEED = 309;       // Chosen so known names don't collide
+
+    static size_t hash(char const *name, size_t length);
+};
+
+#endif /* HEADER_NAME_H_ */
@@ -5,22 +5,26 @@
 // Property in header
 header_property::header_property() : name(""), value("") { }
 
-header_property::header_property(std::string const &property) {
-    size_t begin = 0;
-    size_t end = property.find(':', begin);
+header_property::header_property(std::string const &property) :
+        header_property(property.data(), property.length()) {
+}
 
-    name = to_lower(property.substr(begin, end - begin));
+header_property::header_property(char const *property, size_t length) : name(), value() {
+    size_t end = find_either(property, length, ':', ':');
 
-    // Skip ": "
+    name.assign(property, end);
+    lower_ascii(&name[0], name.length());
 
+    // Skip ": "
     end++;
-    while (end < property.length() && property[end] == ' ') {
+    while (end < length && property[end] == ' ') {
         end++;
     }
-    begin = end;
 
     // Rest is the value
-    value = property.substr(begin, property.size() - begin);
+    if (end < length) {
+        value.assign(property + end, length - end);
+    }
 }
 
 header_property::header_property(std::string const &name,
@@ -52,46 +56,42 @@ void swap(header_property &first, header_property &second) {
 
 // Request from client
 
-request_line::request_line() : type(""), url(""), http("") { }
-
-request_line::request_line(request_type type, std::string url) : url(url), http("HTTP/1.1"){
-    switch (type) {
-        case GET:
-            this->type = "GET";
-            break;
-        case POST:
-            this->type = "POST";
-            break;
-        case OPTION:
-            this->type = "OPTION";
-        case CONNECT:
-            this->type = "CONNECT";
-            break;
+namespace {
+    // Names of methods in order of request_line::request_type
+    char const *const METHODS[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH"};
+}
+
+request_line::request_line() : method(OTHER), type(""), url(""), http("") { }
+
+request_line::request_line(request_type type, std::string url) : method(type), type(""), url(url), http("HTTP/1.1") {
+    if (type != OTHER) {
+        this->type = METHODS[type];
     }
 }
 
 request_line::request_line(std::string const &line) {
     size_t begin = 0;
-    size_t end = line.find(' ', begin);
+    size_t end = find_char(line, ' ', begin);
     type = line.substr(begin, end - begin);
+    method = to_type(type);
 
     begin = end + 1;
-    end = line.find(' ', begin);
-
-    if (line[begin] != '/') {
-//		 Absolute address
-        begin = line.find(':', begin); // find "http:"
-        begin = line.find('/', begin + 3); // skip "://" and find '/'
-    }
+    end = find_char(line, ' ', begin);
 
     url = line.substr(begin, end - begin);
+    // Absolute address is cut to its path, target of CONNECT (host:port) is kept as is
+    size_t scheme = url.find("://");
+    if (method != CONNECT && url[0] != '/' && scheme != std::string::npos) {
+        size_t path = url.find('/', scheme + 3); // skip "://" and find '/'
+        url = path == std::string::npos ? "/" : url.substr(path);
+    }
 
     begin = end + 1;
     http = line.substr(begin, line.size() - begin);
 }
 
 request_line::request_line(request_line const &other) :
-        type(other.type), url(other.url), http(other.http) {
+        method(other.method), type(other.type), url(other.url), http(other.http) {
 }
 
 request_line::request_line(request_line &&other) : request_line() {
@@ -103,17 +103,18 @@ request_line &request_line::operator=(request_line other) {
     return *this;
 }
 
-request_line::request_type request_line::get_type() const {
-    if (type.compare("GET") == 0) {
-        return GET;
-    }
-    if (type.compare("POST") == 0) {
-        return POST;
+request_line::request_type request_line::to_type(std::string const &name) {
+    // Methods are case-sensitive
+    for (size_t i = 0; i < sizeof(METHODS) / sizeof(METHODS[0]); i++) {
+        if (name.compare(METHODS[i]) == 0) {
+            return (request_type) i;
+        }
     }
-    if (type.compare("CONNECT") == 0) {
-        return CONNECT;
-    }
-    return GET;
+    return OTHER;
+}
+
+request_line::request_type request_line::get_type() const {
+    return method;
 }
 
 std::string request_line::get_url() const {
@@ -124,11 +125,19 @@ void request_line::set_url(std::string const &url) {
     this->url = url;
 }
 
+std::string request_line::get_http() const {
+    return http;
+}
+
 std::string to_string(request_line const &line) {
-    return line.type + " " + line.url + " " + line.http + "\r\n";
+    std::string res;
+    res.reserve(line.type.size() + line.url.size() + line.http.size() + 4);
+    res.append(line.type).append(" ").append(line.url).append(" ").append(line.http).append("\r\n");
+    return res;
 }
 
 void swap(request_line &first, request_line &second) {
+    std::swap(first.method, second.method);
     std::swap(first.type, second.type);
     std::swap(first.url, second.url);
     std::swap(first.http, second.http);
@@ -143,11 +152,11 @@ http("HTTP/1.1"){ }
 
 response_line::response_line(std::string const &line) : response_line() {
     size_t begin = 0;
-    size_t end = line.find(' ', begin);
+    size_t end = find_char(line, ' ', begin);
     http = line.substr(begin, end - begin);
     // Skip ' '
     begin = end + 1;
-    end = line.find(' ', begin);
+    end = find_char(line, ' ', begin);
 
     code = std::stoi(line.substr(begin, end - begin));
 
@@ -179,7 +188,11 @@ std::string response_line::get_description() const {
 }
 
 std::string to_string(response_line const &line) {
-    return line.http + " " + std::to_string(line.code) + " " + line.description + "\r\n";
+    std::string code = std::to_string(line.code);
+    std::string res;
+    res.reserve(line.http.size() + code.size() + line.description.size() + 4);
+    res.append(line.http).append(" ").append(code).append(" ").append(line.description).append("\r\n");
+    return res;
 }
 
 void swap(response_line &first, response_line &second) {
@@ -9,7 +9,12 @@
 
 #include <vector>
 #include <string>
+#include <array>
+#include <cstdint>
 #include "util.h"
+#include "char_scan.h"
+#include "header_name.h"
+#include "arena.h"
 
 // Struct that contains HTTP-header property (E.G. "Host: google.com")
 struct header_property {
@@ -18,6 +23,7 @@ public:
 
     header_property();
     explicit header_property(std::string const &property);
+    header_property(char const *property, size_t length);
     header_property(std::string const &name, std::string const &value);
     header_property(header_property const &other);
     header_property(header_property &&other);
@@ -34,18 +40,24 @@ struct http_header {
 public:
     http_header();
     explicit http_header(Line line);
-    explicit http_header(std::string const &message);
+    // Properties of parsed header are kept in <memory>, its copies use heap
+    explicit http_header(std::string const &message, std::shared_ptr<arena> memory = nullptr);
     http_header(http_header<Line> const &other);
     http_header(http_header<Line> &&other);
 
     http_header<Line> &operator=(http_header<Line> other);
 
-    // Functions for work with properties
-    std::string get_property(std::string name) const;
-    int get_int(std::string name) const;
-    bool has_property(std::string name) const;
-    void set_property(std::string name, std::string value);
-    void erase_property(std::string name);
+    // Functions for work with properties. Properties with known names are found in constant time
+    std::string const &get_property(std::string const &name) const;
+    std::string const &get_property(header_name::id name) const;
+    int get_int(std::string const &name) const;
+    int get_int(header_name::id name) const;
+    bool has_property(std::string const &name) const;
+    bool has_property(header_name::id name) const;
+    void set_property(std::string const &name, std::string value);
+    void set_property(header_name::id name, std::string value);
+    void erase_property(std::string const &name);
+    void erase_property(header_name::id name);
 
     // Functions for with first line of header
     void set_request_line(Line line);
@@ -58,15 +70,23 @@ public:
     friend void swap(http_header<L> &first, http_header<L> &second);
 private:
 
-    using properties_t = std::vector<header_property>;
+    using properties_t = std::vector<header_property, arena_allocator<header_property>>;
+    // Position + 1 of first property with known name, 0 if there's no such property
+    using index_t = std::array<uint32_t, header_name::COUNT>;
+
+    void add_property(header_property property);
+    void update_index();
+    static int to_int(std::string const &value);
 
     Line request_line;
-    properties_t properties;
+    properties_t properties;        // All properties in order, unknown ones are found only by scanning
+    index_t index;
 };
 
 struct request_line {
     enum request_type {
-        GET, POST, CONNECT, OPTION
+        GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH,
+        OTHER           // Extension method, its name is kept as is
     };
 
     request_line();
@@ -79,10 +99,14 @@ struct request_line {
     request_type get_type() const;
     std::string get_url() const;
     void set_url(std::string const &url);
+    std::string get_http() const;
     friend std::string to_string(request_line const &request);
 
     friend void swap(request_line &first, request_line &second);
 private:
+    static request_type to_type(std::string const &name);
+
+    request_type method;
     std::string type;
     std::string url;
     std::string http;
@@ -112,50 +136,50 @@ using request_header = http_header<request_line>;
 using response_header = http_header<response_line>;
 
 template<typename Line>
-http_header<Line>::http_header() : request_line(), properties() {
+http_header<Line>::http_header() : request_line(), properties(), index() {
 }
 
 template <typename Line>
-http_header<Line>::http_header(Line line) : request_line(line), properties{} {
+http_header<Line>::http_header(Line line) : request_line(line), properties{}, index() {
 
 }
 
 template<typename Line>
-http_header<Line>::http_header(std::string const &message) : properties() {
+http_header<Line>::http_header(std::string const &message, std::shared_ptr<arena> memory) :
+        properties(arena_allocator<header_property>(std::move(memory))), index() {
     size_t begin = 0;
-    size_t end = message.find('\r', begin);
+    size_t end = find_line_end(message, begin);
     std::string header = message.substr(begin, end - begin);
 
     request_line = Line(header);
 
     while (end < message.size()) {
-        // Skipping \r \n
-        begin = end + 2;
-        end = message.find('\r', begin);
+        // Skipping \r \n (or bare \n)
+        begin = end + ((message[end] == '\r' && end + 1 < message.size() && message[end + 1] == '\n') ? 2 : 1);
+        end = find_line_end(message, begin);
 
         // If we found the end of the header
-        if (begin == end) {
+        if (begin >= message.size() || begin == end) {
             break;
         }
 
-        std::string property = message.substr(begin, end - begin);
-        properties.push_back(header_property(property));
+        add_property(header_property(message.data() + begin, std::min(end, message.size()) - begin));
     }
 
     // Property Proxy-Connection isn't working on some servers
-    if (has_property("proxy-connection")) {
-        std::string value = get_property("proxy-connection");
-        erase_property("proxy-connection");
+    if (has_property(header_name::PROXY_CONNECTION)) {
+        std::string value = get_property(header_name::PROXY_CONNECTION);
+        erase_property(header_name::PROXY_CONNECTION);
 
-        if (!has_property("connection")) {
-            set_property("connection", value);
+        if (!has_property(header_name::CONNECTION)) {
+            set_property(header_name::CONNECTION, value);
         }
     }
 }
 
 template<typename Line>
 http_header<Line>::http_header(http_header<Line> const &other) :
-        request_line(other.request_line), properties(other.properties) {
+        request_line(other.request_line), properties(other.properties), index(other.index) {
 }
 
 template<typename Line>
@@ -170,7 +194,41 @@ http_header<Line> &http_header<Line>::operator=(http_header<Line> other) {
 }
 
 template<typename Line>
-bool http_header<Line>::has_property(std::string name) const {
+void http_header<Line>::add_property(header_property property) {
+    header_name::id id = header_name::find(property.name);
+    properties.push_back(std::move(property));
+    if (id != header_name::UNKNOWN && index[id] == 0) {
+        index[id] = (uint32_t) properties.size();
+    }
+}
+
+template<typename Line>
+void http_header<Line>::update_index() {
+    index.fill(0);
+    for (size_t i = 0; i < properties.size(); i++) {
+        header_name::id id = header_name::find(properties[i].name);
+        if (id != header_name::UNKNOWN && index[id] == 0) {
+            index[id] = (uint32_t) (i + 1);
+        }
+    }
+}
+
+template<typename Line>
+int http_header<Line>::to_int(std::string const &value) {
+    return value.empty() ? 0 : std::stoi(value);
+}
+
+template<typename Line>
+bool http_header<Line>::has_property(header_name::id name) const {
+    return index[name] != 0;
+}
+
+template<typename Line>
+bool http_header<Line>::has_property(std::string const &name) const {
+    header_name::id id = header_name::find(name);
+    if (id != header_name::UNKNOWN) {
+        return has_property(id);
+    }
     for (typename properties_t::const_iterator it = properties.cbegin();
          it != properties.cend(); it++) {
         if (it->name.compare(name) == 0) {
@@ -181,28 +239,57 @@ bool http_header<Line>::has_property(std::string name) const {
 }
 
 template<typename Line>
-std::string http_header<Line>::get_property(std::string name) const {
+std::string const &http_header<Line>::get_property(header_name::id name) const {
+    static std::string const empty;
+    return index[name] == 0 ? empty : properties[index[name] - 1].value;
+}
+
+template<typename Line>
+std::string const &http_header<Line>::get_property(std::string const &name) const {
+    static std::string const empty;
+    header_name::id id = header_name::find(name);
+    if (id != header_name::UNKNOWN) {
+        return get_property(id);
+    }
     for (typename properties_t::const_iterator it = properties.cbegin();
          it != properties.cend(); it++) {
         if (it->name.compare(name) == 0) {
             return it->value;
         }
     }
-    return "";
+    return empty;
 }
 
 template<typename Line>
-int http_header<Line>::get_int(std::string name) const {
-    std::string value = get_property(name);
-    return value.empty() ? 0 : std::stoi(value);
+int http_header<Line>::get_int(header_name::id name) const {
+    return to_int(get_property(name));
+}
+
+template<typename Line>
+int http_header<Line>::get_int(std::string const &name) const {
+    return to_int(get_property(name));
 }
 
 template<typename Line>
-void http_header<Line>::set_property(std::string name, std::string value) {
+void http_header<Line>::set_property(header_name::id name, std::string value) {
+    if (index[name] != 0) {
+        properties[index[name] - 1].value = std::move(value);
+        return;
+    }
+    add_property(header_property(header_name::get(name), std::move(value)));
+}
+
+template<typename Line>
+void http_header<Line>::set_property(std::string const &name, std::string value) {
+    header_name::id id = header_name::find(name);
+    if (id != header_name::UNKNOWN) {
+        set_property(id, std::move(value));
+        return;
+    }
     for (auto it = properties.begin();
          it != properties.end(); it++) {
         if (it->name.compare(name) == 0) {
-            it->value = value;
+            it->value = std::move(value);
             return;
         }
     }
@@ -210,10 +297,24 @@ void http_header<Line>::set_property(std::string name, std::string value) {
 }
 
 template<typename Line>
-void http_header<Line>::erase_property(std::string name) {
+void http_header<Line>::erase_property(header_name::id name) {
+    if (index[name] != 0) {
+        properties.erase(properties.begin() + (index[name] - 1));
+        update_index();
+    }
+}
+
+template<typename Line>
+void http_header<Line>::erase_property(std::string const &name) {
+    header_name::id id = header_name::find(name);
+    if (id != header_name::UNKNOWN) {
+        erase_property(id);
+        return;
+    }
     for (auto it = properties.begin(); it != properties.end(); it++) {
         if (it->name.compare(name) == 0) {
             properties.erase(it);
+            update_index();
             return;
         }
     }
@@ -238,15 +339,22 @@ template<typename Line>
 void swap(http_header<Line> &first, http_header<Line> &second) {
     swap(first.request_line, second.request_line);
     first.properties.swap(second.properties);
+    first.index.swap(second.index);
 }
 
 template<typename Line>
 std::string to_string(http_header<Line> const &header) {
-    std::string result = to_string(header.request_line);
-
-    for (typename http_header<Line>::properties_t::const_iterator it =
-            header.properties.cbegin(); it != header.properties.cend(); it++) {
-        result.append(to_string(*it));
+    std::string line = to_string(header.request_line);
+    // Whole header is built in one string
+    size_t length = line.size() + 2;
+    for (header_property const &property : header.properties) {
+        length += property.name.size() + property.value.size() + 4;
+    }
+    std::string result;
+    result.reserve(length);
+    result.append(line);
+    for (header_property const &property : header.properties) {
+        result.append(property.name).append(": ").append(property.value).append("\r\n");
     }
     result += "\r\n";
     return result;
@@ -0,0 +1,27 @@
+#include "load_lease.h"
+
+#include <utility>
+
+load_lease::load_lease() : load() { }
+
+load_lease::load_lease(std::shared_ptr<size_t> load) : load(std::move(load)) {
+    ++*this->load;
+}
+
+load_lease::load_lease(load_lease &&other) : load(std::move(other.load)) { }
+
+load_lease &load_lease::operator=(load_lease &&other) {
+    load_lease tmp(std::move(other));
+    swap(*this, tmp);
+    return *this;
+}
+
+load_lease::~load_lease() {
+    if (load) {
+        --*load;
+    }
+}
+
+void swap(load_lease &first, load_lease &second) {
+    std::swap(first.load, second.load);
+}
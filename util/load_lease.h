@@ -0,0 +1,30 @@
+/*
+ * load_lease.h
+ *
+ * Counter of requests that an upstream handles
+ */
+
+#ifndef LOAD_LEASE_H_
+#define LOAD_LEASE_H_
+
+#include <memory>
+#include <cstddef>
+
+// Request that upstream (member of cluster, parent proxy) handles. Load of upstream is taken
+// while lease exists and released when it's destroyed
+struct load_lease {
+    load_lease();
+    explicit load_lease(std::shared_ptr<size_t> load);
+    load_lease(load_lease &&other);
+    load_lease &operator=(load_lease &&other);
+    ~load_lease();
+
+    friend void swap(load_lease &first, load_lease &second);
+
+private:
+    std::shared_ptr<size_t> load;
+};
+
+void swap(load_lease &first, load_lease &second);
+
+#endif /* LOAD_LEASE_H_ */
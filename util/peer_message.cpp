@@ -0,0 +1,57 @@
+#include "peer_message.h"
+
+#include "util.h"
+
+namespace {
+    char const *const OPCODES[] = {"QUERY", "HIT", "MISS"};
+}
+
+peer_message::peer_message() : op(QUERY), id(0), key() { }
+
+peer_message::peer_message(opcode op, uint32_t id, std::string key) : op(op), id(id), key(std::move(key)) { }
+
+peer_message::peer_message(char const *data, size_t length) : peer_message() {
+    std::string message(data, length);
+    size_t first = message.find(' ');
+    size_t second = first == std::string::npos ? std::string::npos : message.find(' ', first + 1);
+    if (second == std::string::npos || length > MAX_LENGTH) {
+        throw annotated_exception("peer message", "bad format");
+    }
+
+    std::string name = message.substr(0, first);
+    size_t i = 0;
+    while (i < sizeof OPCODES / sizeof OPCODES[0] && name.compare(OPCODES[i]) != 0) {
+        i++;
+    }
+    if (i == sizeof OPCODES / sizeof OPCODES[0]) {
+        throw annotated_exception("peer message", "unknown opcode " + name);
+    }
+    op = (opcode) i;
+
+    std::string number = message.substr(first + 1, second - first - 1);
+    if (number.empty() || number.size() > 10 || number.find_first_not_of("0123456789") != std::string::npos) {
+        throw annotated_exception("peer message", "bad id");
+    }
+    id = (uint32_t) std::stoul(number);
+    key = message.substr(second + 1);
+}
+
+peer_message::opcode peer_message::get_opcode() const {
+    return op;
+}
+
+uint32_t peer_message::get_id() const {
+    return id;
+}
+
+std::string const &peer_message::get_key() const {
+    return key;
+}
+
+peer_message peer_message::answer(bool hit) const {
+    return peer_message(hit ? HIT : MISS, id, key);
+}
+
+std::string to_string(peer_message const &message) {
+    return std::string(OPCODES[message.op]) + " " + std::to_string(message.id) + " " + message.key;
+}
@@ -0,0 +1,42 @@
+/*
+ * peer_message.h
+ *
+ * Protocol of cache queries between sibling proxies (like ICP)
+ */
+
+#ifndef PEER_MESSAGE_H_
+#define PEER_MESSAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// One datagram "<opcode> <id> <key>". Proxy sends QUERY with key of response it doesn't have, peers
+// answer with HIT if they have it fresh and MISS otherwise. Answer repeats id and key of query
+struct peer_message {
+    enum opcode {
+        QUERY, HIT, MISS
+    };
+
+    static const size_t MAX_LENGTH = 4096;
+
+    peer_message();
+    peer_message(opcode op, uint32_t id, std::string key);
+    // Parse datagram, throws annotated_exception if it's malformed
+    peer_message(char const *data, size_t length);
+
+    opcode get_opcode() const;
+    uint32_t get_id() const;
+    std::string const &get_key() const;
+
+    // Answer to this query
+    peer_message answer(bool hit) const;
+
+    friend std::string to_string(peer_message const &message);
+private:
+    opcode op;
+    uint32_t id;
+    std::string key;
+};
+
+#endif /* PEER_MESSAGE_H_ */
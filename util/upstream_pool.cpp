@@ -0,0 +1,109 @@
+#include "upstream_pool.h"
+
+#include <algorithm>
+
+const double upstream_pool::DECAY = 0.3;
+const double upstream_pool::SLOW_FACTOR = 3;
+const double upstream_pool::SLOW_MARGIN = 5;
+const double upstream_pool::SKIP_DECAY = 0.05;
+
+upstream_pool::upstream_pool() : parents() { }
+
+upstream_pool::upstream_pool(std::vector<unsigned> const &weights) : parents() {
+    for (unsigned weight : weights) {
+        parents.push_back({std::max(weight, 1u), std::make_shared<size_t>(0), 0, false, 0, 0});
+    }
+}
+
+bool upstream_pool::empty() const {
+    return parents.empty();
+}
+
+size_t upstream_pool::size() const {
+    return parents.size();
+}
+
+size_t upstream_pool::pick() {
+    std::vector<size_t> candidates = get_candidates();
+
+    // Least connections per weight
+    std::vector<size_t> least;
+    for (size_t i : candidates) {
+        if (!least.empty()) {
+            upstream const &best = parents[least.front()];
+            size_t load = *parents[i].active * best.weight, best_load = *best.active * parents[i].weight;
+            if (load > best_load) {
+                continue;
+            }
+            if (load < best_load) {
+                least.clear();
+            }
+        }
+        least.push_back(i);
+    }
+
+    // Smooth weighted round robin between equally loaded parents
+    long total = 0;
+    size_t res = least.front();
+    for (size_t i : least) {
+        parents[i].current += parents[i].weight;
+        total += parents[i].weight;
+        if (parents[i].current > parents[res].current) {
+            res = i;
+        }
+    }
+    parents[res].current -= total;
+    return res;
+}
+
+std::vector<size_t> upstream_pool::get_candidates() {
+    bool any_healthy = false;
+    double best_latency = -1;
+    for (size_t i = 0; i < parents.size(); i++) {
+        if (is_healthy(i)) {
+            any_healthy = true;
+            if (parents[i].measured && (best_latency < 0 || parents[i].latency < best_latency)) {
+                best_latency = parents[i].latency;
+            }
+        }
+    }
+
+    std::vector<size_t> res;
+    for (size_t i = 0; i < parents.size(); i++) {
+        bool slow = best_latency >= 0 && parents[i].latency > best_latency * SLOW_FACTOR + SLOW_MARGIN;
+        if (slow) {
+            parents[i].latency *= 1 - SKIP_DECAY;
+        } else if (!any_healthy || is_healthy(i)) {
+            res.push_back(i);
+        }
+    }
+    if (res.empty()) {
+        for (size_t i = 0; i < parents.size(); i++) {
+            res.push_back(i);
+        }
+    }
+    return res;
+}
+
+load_lease upstream_pool::acquire(size_t parent) {
+    return load_lease(parents[parent].active);
+}
+
+void upstream_pool::report_success(size_t parent, double latency) {
+    upstream &res = parents[parent];
+    res.latency = res.measured ? (1 - DECAY) * res.latency + DECAY * latency : latency;
+    res.measured = true;
+    res.failures = 0;
+}
+
+void upstream_pool::report_failure(size_t parent) {
+    parents[parent].failures++;
+}
+
+bool upstream_pool::is_healthy(size_t parent) const {
+    return parents[parent].failures < MAX_FAILURES;
+}
+
+double upstream_pool::get_latency(size_t parent) const {
+    return parents[parent].latency;
+}
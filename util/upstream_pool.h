@@ -0,0 +1,65 @@
+/*
+ * upstream_pool.h
+ *
+ * Choice of parent proxy for request
+ */
+
+#ifndef UPSTREAM_POOL_H_
+#define UPSTREAM_POOL_H_
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "load_lease.h"
+
+// Weighted pool of parent proxies. Parent with the least active requests per weight is picked, ties are
+// broken by smooth weighted round robin. Parent whose EWMA of latency is more than SLOW_FACTOR times
+// (and SLOW_MARGIN ms) worse than the best one is drained. Its latency decays by SKIP_DECAY for every
+// request it misses, so it's tried again later.
+// Parent that fails MAX_FAILURES times in a row is unhealthy and isn't picked until it succeeds again
+// (E.G. passes active check). If no parent fits, all are used
+struct upstream_pool {
+    static const size_t NONE = (size_t) -1;     // No parent, E.G. connection goes straight to server
+
+    upstream_pool();
+    // Pool of parents with <weights>
+    explicit upstream_pool(std::vector<unsigned> const &weights);
+
+    bool empty() const;
+    size_t size() const;
+
+    // Parent for the next request. Pool shouldn't be empty
+    size_t pick();
+    load_lease acquire(size_t parent);
+
+    // Results of requests and checks. Latency is in milliseconds
+    void report_success(size_t parent, double latency);
+    void report_failure(size_t parent);
+
+    bool is_healthy(size_t parent) const;
+    double get_latency(size_t parent) const;
+
+private:
+    static const size_t MAX_FAILURES = 3;
+    static const double DECAY;          // Weight of new latency in EWMA
+    static const double SLOW_FACTOR;
+    static const double SLOW_MARGIN;
+    static const double SKIP_DECAY;
+
+    struct upstream {
+        unsigned weight;
+        std::shared_ptr<size_t> active;
+        double latency;
+        bool measured;                  // False until the first latency is reported
+        size_t failures;                // Failures in a row
+        long current;                   // Weight of round robin
+    };
+
+    // Parents that can take request now
+    std::vector<size_t> get_candidates();
+
+    std::vector<upstream> parents;
+};
+
+#endif /* UPSTREAM_POOL_H_ */
@@ -1,14 +1,24 @@
 #include "util.h"
+#include "char_scan.h"
 
 void log(annotated_exception const& e) {
     log("ERROR", e.what());
 }
 
 std::string to_lower(std::string other) {
-    std::transform(other.begin(), other.end(), other.begin(), ::tolower);
+    lower_ascii(&other[0], other.length());
     return other;
 }
 
+std::string trim(std::string const &str) {
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
 annotated_exception::annotated_exception() noexcept : message(""), errnum(0) {
 
 }
@@ -52,6 +52,16 @@ struct simple_cache {
     void erase(K key);
     size_t size() const;
 
+    // Key of the least recently inserted element, it's evicted by the next insert to full cache
+    K const &get_first() const;
+
+    // Remove the least recently inserted element and return it
+    std::pair<K, V> pop_first();
+
+    // Call func(key, value) for every element from the least recently inserted
+    template<typename F>
+    void for_each(F func) const;
+
 private:
     struct entry;
     using values_t = std::map<K, entry>;
@@ -95,6 +105,9 @@ void log(annotated_exception const &e);
 // To lower case
 std::string to_lower(std::string str);
 
+// Without leading and trailing spaces and tabs
+std::string trim(std::string const &str);
+
 template<typename K, typename V, size_t MAX_SIZE>
 simple_cache<K, V, MAX_SIZE>::simple_cache() : values{}, first(values.begin()), last(values.end()) {
 }
@@ -172,4 +185,36 @@ size_t simple_cache<K, V, MAX_SIZE>::size() const {
     return values.size();
 }
 
+template<typename K, typename V, size_t MAX_SIZE>
+K const &simple_cache<K, V, MAX_SIZE>::get_first() const {
+    if (values.empty()) {
+        throw annotated_exception("simple cache", "cache is empty");
+    }
+    return first->first;
+}
+
+template<typename K, typename V, size_t MAX_SIZE>
+std::pair<K, V> simple_cache<K, V, MAX_SIZE>::pop_first() {
+    if (values.empty()) {
+        throw annotated_exception("simple cache", "cache is empty");
+    }
+    std::pair<K, V> result(first->first, std::move(first->second.value));
+    erase(result.first);
+    return result;
+}
+
+template<typename K, typename V, size_t MAX_SIZE>
+template<typename F>
+void simple_cache<K, V, MAX_SIZE>::for_each(F func) const {
+    if (values.empty()) {
+        return;
+    }
+    for (auto it = first; ; it = it->second.next) {
+        func(it->first, it->second.value);
+        if (it == last) {
+            break;
+        }
+    }
+}
+
 #endif /* UTIL_H_ */
@@ -1,5 +1,41 @@
 #include "wraps.h"
 
+io_result::io_result() : value(0), errnum(0) { }
+
+io_result::io_result(long value, int errnum) : value(value), errnum(errnum) { }
+
+io_result io_result::of(long value) {
+    return value == -1 ? io_result(-1, errno) : io_result(value, 0);
+}
+
+bool io_result::is_ok() const {
+    return value != -1;
+}
+
+bool io_result::should_retry() const {
+    return value == -1 && (errnum == EAGAIN || errnum == EWOULDBLOCK || errnum == EINTR);
+}
+
+bool io_result::in_progress() const {
+    return value == -1 && errnum == EINPROGRESS;
+}
+
+bool io_result::is_error() const {
+    return value == -1 && !should_retry() && !in_progress();
+}
+
+long io_result::get() const {
+    return value;
+}
+
+int io_result::get_errno() const {
+    return errnum;
+}
+
+annotated_exception io_result::get_exception(std::string tag) const {
+    return annotated_exception(std::move(tag), errnum);
+}
+
 file_descriptor::file_descriptor() :
         fd(0) {
 }
@@ -41,21 +77,27 @@ int file_descriptor::can_read() const {
 }
 
 long file_descriptor::read(void *message, size_t message_size) const {
-    long read = ::read(fd, message, message_size);
-    if (read == -1) {
-        int err = errno;
-        throw annotated_exception("read", err);
+    io_result read = try_read(message, message_size);
+    if (!read.is_ok()) {
+        throw read.get_exception("read");
     }
-    return read;
+    return read.get();
 }
 
 long file_descriptor::write(void const *message, size_t message_size) const {
-    long written = ::write(fd, message, message_size);
-    if (written == -1) {
-        int err = errno;
-        throw annotated_exception("write", err);
+    io_result written = try_write(message, message_size);
+    if (!written.is_ok()) {
+        throw written.get_exception("write");
     }
-    return written;
+    return written.get();
+}
+
+io_result file_descriptor::try_read(void *message, size_t message_size) const {
+    return io_result::of(::read(fd, message, message_size));
+}
+
+io_result file_descriptor::try_write(void const *message, size_t message_size) const {
+    return io_result::of(::write(fd, message, message_size));
 }
 
 void swap(file_descriptor &first, file_descriptor &second) {
@@ -91,6 +133,17 @@ void timer_fd::set_interval(long interval_sec, long start_after_sec) const {
     }
 }
 
+void timer_fd::set_timeout_ms(long msec) const {
+    itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+    spec.it_value.tv_sec = msec / 1000;
+    spec.it_value.tv_nsec = (msec % 1000) * 1000000;
+    if (timerfd_settime(fd, 0, &spec, 0) == -1) {
+        int err = errno;
+        throw annotated_exception("timerfd", err);
+    }
+}
+
 int timer_fd::value_of(std::initializer_list<fd_mode> mode) {
     int res = 0;
     for (auto it = mode.begin(); it != mode.end(); it++) {
@@ -178,6 +231,92 @@ int signal_fd::value_of(std::initializer_list<fd_mode> mode) {
     return res;
 }
 
+memory_map::memory_map() : data(nullptr), length(0) { }
+
+memory_map::memory_map(file_descriptor const &fd, size_t length, bool writable) : data(nullptr), length(length) {
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *res = mmap(nullptr, length, prot, MAP_SHARED, fd.get(), 0);
+    if (res == MAP_FAILED) {
+        int err = errno;
+        throw annotated_exception("mmap", err);
+    }
+    data = static_cast<char *>(res);
+}
+
+memory_map::memory_map(memory_map &&other) : memory_map() {
+    swap(*this, other);
+}
+
+memory_map &memory_map::operator=(memory_map &&other) {
+    swap(*this, other);
+    return *this;
+}
+
+memory_map::~memory_map() {
+    if (data != nullptr) {
+        munmap(data, length);
+    }
+}
+
+char *memory_map::get() const {
+    return data;
+}
+
+size_t memory_map::size() const {
+    return length;
+}
+
+void swap(memory_map &first, memory_map &second) {
+    std::swap(first.data, second.data);
+    std::swap(first.length, second.length);
+}
+
+namespace {
+    std::array<int, 2> open_pipe() {
+        std::array<int, 2> fds = {{-1, -1}};
+        if (pipe2(fds.data(), O_NONBLOCK | O_CLOEXEC) == -1) {
+            int err = errno;
+            throw annotated_exception("pipe", err);
+        }
+        return fds;
+    }
+}
+
+pipe_wrap::pipe_wrap() : pipe_wrap(open_pipe()) { }
+
+pipe_wrap::pipe_wrap(std::array<int, 2> const &fds) : read_end(fds[0]), write_end(fds[1]), length(0), capacity(0) {
+    // Bigger pipe means fewer wakeups, default size is used if it can't be changed
+    fcntl(write_end.get(), F_SETPIPE_SZ, PIPE_SIZE);
+    int size = fcntl(write_end.get(), F_GETPIPE_SZ);
+    capacity = size > 0 ? (size_t) size : 64 * 1024;
+}
+
+io_result pipe_wrap::splice_from(file_descriptor const &from, size_t length) {
+    io_result res = io_result::of(::splice(from.get(), nullptr, write_end.get(), nullptr, length,
+                                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+    if (res.is_ok()) {
+        this->length += res.get();
+    }
+    return res;
+}
+
+io_result pipe_wrap::splice_to(file_descriptor const &to) {
+    io_result res = io_result::of(::splice(read_end.get(), nullptr, to.get(), nullptr, length,
+                                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+    if (res.is_ok()) {
+        length -= res.get();
+    }
+    return res;
+}
+
+size_t pipe_wrap::get_length() const {
+    return length;
+}
+
+size_t pipe_wrap::get_space() const {
+    return length < capacity ? capacity - length : 0;
+}
+
 socket_wrap::socket_wrap() :
         file_descriptor() {
 }
@@ -212,10 +351,10 @@ int socket_wrap::value_of(std::initializer_list<socket_mode> modes) const {
                 mode |= 0;
                 break;
             case NONBLOCK:
-                mode |= O_NONBLOCK;
+                mode |= SOCK_NONBLOCK;
                 break;
             case CLOEXEC:
-                mode |= O_CLOEXEC;
+                mode |= SOCK_CLOEXEC;
                 break;
             default:
                 mode |= 0;
@@ -235,13 +374,20 @@ socket_wrap socket_wrap::accept(socket_mode mode) const {
 }
 
 socket_wrap socket_wrap::accept(std::initializer_list<socket_mode> mode) const {
+    io_result result;
+    socket_wrap res = try_accept(mode, result);
+    if (!result.is_ok()) {
+        throw result.get_exception("accept");
+    }
+    return res;
+}
 
-    int new_fd = ::accept4(fd, 0, 0, value_of(mode));
-    if (new_fd == -1) {
-        int err = errno;
-        throw annotated_exception("accept", err);
+socket_wrap socket_wrap::try_accept(std::initializer_list<socket_mode> mode, io_result &result) const {
+    result = io_result::of(::accept4(fd, 0, 0, value_of(mode)));
+    if (!result.is_ok()) {
+        return socket_wrap();
     }
-    return socket_wrap(new_fd);
+    return socket_wrap((int) result.get());
 }
 
 void socket_wrap::bind(uint16_t port) const {
@@ -258,6 +404,13 @@ void socket_wrap::bind(uint16_t port) const {
 }
 
 void socket_wrap::connect(endpoint address) const {
+    io_result result = try_connect(address);
+    if (!result.is_ok()) {
+        throw result.get_exception("connect");
+    }
+}
+
+io_result socket_wrap::try_connect(endpoint address) const {
     sockaddr_in addr;
     memset(&addr, 0, sizeof addr);
 
@@ -265,10 +418,7 @@ void socket_wrap::connect(endpoint address) const {
     addr.sin_port = address.port;
     addr.sin_addr.s_addr = address.ip;
 
-    if (::connect(fd, (struct sockaddr *) (&addr), sizeof(addr))) {
-        int err = errno;
-        throw annotated_exception("connect", err);
-    }
+    return io_result::of(::connect(fd, (struct sockaddr *) (&addr), sizeof(addr)));
 }
 
 void socket_wrap::listen(int max_queue_size) const {
@@ -294,6 +444,66 @@ std::string to_string(socket_wrap &wrap) {
     return "socket " + std::to_string(wrap.get());
 }
 
+datagram_socket::datagram_socket() : file_descriptor() { }
+
+datagram_socket::datagram_socket(std::initializer_list<socket_mode> mode) : file_descriptor() {
+    fd = socket(AF_INET, SOCK_DGRAM | value_of(mode), 0);
+    if (fd == -1) {
+        int err = errno;
+        throw annotated_exception("socket", err);
+    }
+}
+
+void datagram_socket::bind(uint16_t port) const {
+    sockaddr_in addr = {};
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+        int err = errno;
+        throw annotated_exception("bind", err);
+    }
+}
+
+io_result datagram_socket::try_send_to(void const *message, size_t message_size, endpoint address) const {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = address.port;
+    addr.sin_addr.s_addr = address.ip;
+
+    return io_result::of(sendto(fd, message, message_size, 0, reinterpret_cast<struct sockaddr *>(&addr),
+                                sizeof(addr)));
+}
+
+io_result datagram_socket::try_receive_from(void *message, size_t message_size, endpoint &address) const {
+    sockaddr_in addr = {};
+    socklen_t length = sizeof(addr);
+    io_result res = io_result::of(recvfrom(fd, message, message_size, 0, reinterpret_cast<struct sockaddr *>(&addr),
+                                           &length));
+    address = {addr.sin_addr.s_addr, addr.sin_port};
+    return res;
+}
+
+int datagram_socket::value_of(std::initializer_list<socket_mode> mode) const {
+    int res = 0;
+    for (auto it = mode.begin(); it != mode.end(); it++) {
+        switch (*it) {
+            case NONBLOCK:
+                res |= SOCK_NONBLOCK;
+                break;
+            case CLOEXEC:
+                res |= SOCK_CLOEXEC;
+                break;
+            case SIMPLE:
+                res |= 0;
+                break;
+        }
+    }
+    return res;
+}
+
 
 fd_state::fd_state() :
         fd_st(0) {
@@ -384,7 +594,7 @@ void swap(fd_state &first, fd_state &second) {
 
 epoll_wrap::epoll_wrap(int max_queue_size) :
         file_descriptor(), queue_size(max_queue_size), events(
-        new epoll_event[max_queue_size]), handlers{}, started{false}, stopped{
+        new epoll_event[max_queue_size]), handlers{}, running(nullptr), started{false}, stopped{
         true} {
     fd = epoll_create(1);
     if (fd == -1) {
@@ -393,10 +603,18 @@ epoll_wrap::epoll_wrap(int max_queue_size) :
     }
 }
 
-epoll_wrap::epoll_wrap(epoll_wrap &&other) {
+epoll_wrap::epoll_wrap(epoll_wrap &&other) : file_descriptor(), queue_size(0), events(), handlers{},
+                                              running(nullptr), started{false}, stopped{true} {
     swap(*this, other);
 }
 
+epoll_wrap::handler_slot::handler_slot() : handlers(), current(0), registered(false), error_queue() {
+}
+
+bool epoll_wrap::handler_slot::contains(handler_t const *handler) const {
+    return handler == &handlers[0] || handler == &handlers[1];
+}
+
 epoll_event epoll_wrap::create_event(int fd,
                                      fd_state const &st) {
     epoll_event event;
@@ -418,7 +636,7 @@ void epoll_wrap::register_fd(const file_descriptor &fd, fd_state events) {
 void epoll_wrap::register_fd(const file_descriptor &fd, fd_state events,
                              handler_t handler) {
     register_fd(fd, events);
-    handlers.insert({fd.get(), handler});
+    set_handler(fd.get(), std::move(handler));
 }
 
 void epoll_wrap::unregister_fd(const file_descriptor &fd) {
@@ -426,7 +644,16 @@ void epoll_wrap::unregister_fd(const file_descriptor &fd) {
         int err = errno;
         throw annotated_exception("epoll_unregister", err);
     }
-    handlers.erase(fd.get());
+    handlers_t::iterator it = handlers.find(fd.get());
+    if (it == handlers.end()) {
+        return;
+    }
+    if (it->second.contains(running)) {
+        // Handler is running now, it will be deleted after return
+        it->second.registered = false;
+    } else {
+        handlers.erase(it);
+    }
 }
 
 void epoll_wrap::update_fd(const file_descriptor &fd, fd_state events) {
@@ -438,8 +665,24 @@ void epoll_wrap::update_fd(const file_descriptor &fd, fd_state events) {
 }
 
 void epoll_wrap::update_fd_handler(const file_descriptor &fd, epoll_wrap::handler_t handler) {
-    handlers.erase(fd.get());
-    handlers.insert({fd.get(), handler});
+    set_handler(fd.get(), std::move(handler));
+}
+
+void epoll_wrap::set_error_queue_handler(const file_descriptor &fd, error_queue_handler_t handler) {
+    handlers_t::iterator it = handlers.find(fd.get());
+    if (it != handlers.end()) {
+        it->second.error_queue = std::move(handler);
+    }
+}
+
+void epoll_wrap::set_handler(int fd, handler_t &&handler) {
+    handler_slot &slot = handlers[fd];
+    if (&slot.handlers[slot.current] == running) {
+        // Don't touch running handler, use the other place
+        slot.current = (slot.current + 1) % 2;
+    }
+    slot.handlers[slot.current] = std::move(handler);
+    slot.registered = true;
 }
 
 void epoll_wrap::start_wait() {
@@ -463,9 +706,24 @@ void epoll_wrap::start_wait() {
             int fd = events[i].data.fd;
             uint32_t state = events[i].events;
             handlers_t::iterator it = handlers.find(fd);
-            if (it != handlers.end()) {
-                handler_t handler = it->second;
-                handler(fd_state(state));
+            if (it != handlers.end() && it->second.registered && (state & EPOLLERR) != 0 && it->second.error_queue &&
+                it->second.error_queue()) {
+                state &= ~EPOLLERR;
+            }
+            if (it != handlers.end() && it->second.registered && state != 0) {
+                handler_slot &slot = it->second;
+                handler_t *called = &slot.handlers[slot.current];
+
+                running = called;
+                (*called)(fd_state(state));
+                running = nullptr;
+
+                if (!slot.registered) {
+                    handlers.erase(it);
+                } else if (&slot.handlers[slot.current] != called) {
+                    // Handler was replaced during the call
+                    *called = nullptr;
+                }
             }
             if (stopped) {
                 break;
@@ -487,6 +745,7 @@ void swap(epoll_wrap &first, epoll_wrap &second) {
     swap(first.stopped, second.stopped);
     swap(first.events, second.events);
     swap(first.handlers, second.handlers);
+    swap(first.running, second.running);
 }
 
 void swap(endpoint &first, endpoint &second) {
@@ -510,7 +769,7 @@ epoll_registration::epoll_registration(epoll_wrap &epoll, file_descriptor&& fd,
 epoll_registration::epoll_registration(epoll_wrap &epoll, file_descriptor&& fd, fd_state state,
                                        epoll_wrap::handler_t handler) : epoll(&epoll), fd(std::move(fd)),
                                                                         events(state) {
-    this->epoll->register_fd(this->fd, state, handler);
+    this->epoll->register_fd(this->fd, state, std::move(handler));
 }
 
 epoll_registration::epoll_registration(epoll_registration &&other) : epoll_registration() {
@@ -537,12 +796,12 @@ void epoll_registration::update(fd_state state) {
 }
 
 void epoll_registration::update(epoll_wrap::handler_t handler) {
-    epoll->update_fd_handler(fd, handler);
+    epoll->update_fd_handler(fd, std::move(handler));
 }
 
 void epoll_registration::update(fd_state state, epoll_wrap::handler_t handler) {
     update(state);
-    update(handler);
+    update(std::move(handler));
 }
 
 file_descriptor &epoll_registration::get_fd() {
@@ -8,6 +8,7 @@
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <signal.h>
 #include <netinet/in.h>
@@ -18,11 +19,40 @@
 #include <fcntl.h>
 
 #include <algorithm>
+#include <array>
 #include <functional>
 #include <map>
 #include <memory>
 
 #include "util.h"
+#include "event_handler.h"
+
+// Result of system call in event loop: value or errno. Errors that are normal for nonblocking
+// descriptors (EAGAIN, EINPROGRESS) are returned instead of thrown, so nothing is unwound or allocated
+struct io_result {
+    io_result();
+    // Result of call that returned <value>, errno is saved if it's -1
+    static io_result of(long value);
+
+    bool is_ok() const;
+    // Nothing was done, descriptor isn't ready (EAGAIN, EWOULDBLOCK, EINTR)
+    bool should_retry() const;
+    // Nonblocking connect is started
+    bool in_progress() const;
+    // Failed and won't succeed later
+    bool is_error() const;
+
+    long get() const;
+    int get_errno() const;
+
+    // Exception to log or throw if result is an error
+    annotated_exception get_exception(std::string tag) const;
+private:
+    io_result(long value, int errnum);
+
+    long value;
+    int errnum;
+};
 
 // Wrap for unix file descriptor
 struct file_descriptor {
@@ -41,6 +71,10 @@ struct file_descriptor {
     long read(void *message, size_t message_size) const;
     long write(void const *message, size_t message_size) const;
 
+    // Same without exceptions, for event loop
+    io_result try_read(void *message, size_t message_size) const;
+    io_result try_write(void const *message, size_t message_size) const;
+
     friend void swap(file_descriptor &first, file_descriptor &second);
     friend std::string to_string(file_descriptor const &fd);
 protected:
@@ -63,6 +97,8 @@ struct timer_fd : file_descriptor {
 
     // Set interval for ticking
     void set_interval(long interval_sec, long start_after_sec) const;
+    // Tick once after <msec> milliseconds, 0 disarms timer
+    void set_timeout_ms(long msec) const;
 
 private:
     int value_of(std::initializer_list<fd_mode> mode);
@@ -96,6 +132,45 @@ private:
     int value_of(std::initializer_list<fd_mode> mode);
 };
 
+// Wrap for memory mapping of a file. Unmaps in destructor
+struct memory_map {
+    memory_map();
+    memory_map(file_descriptor const &fd, size_t length, bool writable);
+    memory_map(memory_map &&other);
+    memory_map &operator=(memory_map &&other);
+
+    ~memory_map();
+
+    char *get() const;
+    size_t size() const;
+
+    friend void swap(memory_map &first, memory_map &second);
+private:
+    char *data;
+    size_t length;
+};
+
+// Wrap for pipe that moves data between descriptors inside kernel with splice, without copying it to user space
+struct pipe_wrap {
+    pipe_wrap();
+
+    // Move at most <length> bytes from <from> to pipe
+    io_result splice_from(file_descriptor const &from, size_t length);
+    // Move data from pipe to <to>
+    io_result splice_to(file_descriptor const &to);
+
+    // Bytes that are in pipe and free space of it
+    size_t get_length() const;
+    size_t get_space() const;
+private:
+    static const int PIPE_SIZE = 256 * 1024;       // Requested, kernel may give less
+
+    explicit pipe_wrap(std::array<int, 2> const &fds);
+
+    file_descriptor read_end, write_end;
+    size_t length, capacity;
+};
+
 // IPv4 endpoint
 struct endpoint {
     uint32_t ip;
@@ -118,12 +193,16 @@ struct socket_wrap : file_descriptor {
     // Accept other socket
     socket_wrap accept(socket_mode mode) const;
     socket_wrap accept(std::initializer_list<socket_mode> mode) const;
+    // Same without exceptions. Returned socket is empty if <result> isn't ok
+    socket_wrap try_accept(std::initializer_list<socket_mode> mode, io_result &result) const;
 
     // Bing to port
     void bind(uint16_t port) const;
 
     // Connect to endpoint
     void connect(endpoint address) const;
+    // Same without exceptions, nonblocking connect gives in_progress()
+    io_result try_connect(endpoint address) const;
 
     // Listen to incoming connections
     void listen(int queue_size) const;
@@ -140,6 +219,26 @@ private:
     int value_of(std::initializer_list<socket_mode> modes) const;
 };
 
+// Wrap for UDP socket
+struct datagram_socket : file_descriptor {
+    enum socket_mode {
+        NONBLOCK, CLOEXEC, SIMPLE
+    };
+
+    datagram_socket();
+    datagram_socket(std::initializer_list<socket_mode> mode);
+
+    // Bind to port
+    void bind(uint16_t port) const;
+
+    // Send one datagram to <address> or receive one and its sender
+    io_result try_send_to(void const *message, size_t message_size, endpoint address) const;
+    io_result try_receive_from(void *message, size_t message_size, endpoint &address) const;
+
+private:
+    int value_of(std::initializer_list<socket_mode> mode) const;
+};
+
 // State of file descriptor in epoll
 struct fd_state {
     enum state {
@@ -171,9 +270,13 @@ private:
 };
 
 // Wrap for epoll. After state of file_descriptor becomes equal to state it was registered to,
-// handler is called with current fd_state
+// handler is called with current fd_state.
+// Handlers are called in place, without copying. If handler is replaced during its own call, it stays alive
+// until the call returns
 struct epoll_wrap : file_descriptor {
-    using handler_t = std::function<void(fd_state)>;
+    using handler_t = event_handler<void(fd_state), 192>;
+    // Reads error queue of file descriptor, returns false if it was empty
+    using error_queue_handler_t = std::function<bool()>;
 
     epoll_wrap(int max_queue_size);
     epoll_wrap(epoll_wrap &&other);
@@ -189,6 +292,11 @@ struct epoll_wrap : file_descriptor {
     void update_fd(const file_descriptor &fd, fd_state events);
     void update_fd_handler(const file_descriptor &fd, handler_t handler);
 
+    // Set handler of error queue of registered file descriptor (E.G. for MSG_ZEROCOPY completions). It's called
+    // when ERROR comes, before usual handler. If it has read something, ERROR isn't passed to usual handler:
+    // real error of socket is reported again by next wait
+    void set_error_queue_handler(const file_descriptor &fd, error_queue_handler_t handler);
+
     // Start epoll
     void start_wait();
 
@@ -197,13 +305,28 @@ struct epoll_wrap : file_descriptor {
 
     friend void swap(epoll_wrap &first, epoll_wrap &second);
 private:
-    using handlers_t = std::map<int, handler_t>;
+    // Place for handler of one file descriptor. Has room for a new handler while the current one is running
+    struct handler_slot {
+        handler_t handlers[2];
+        size_t current;
+        bool registered;
+        error_queue_handler_t error_queue;
+
+        handler_slot();
+
+        // Is handler from this slot placed at <handler>
+        bool contains(handler_t const *handler) const;
+    };
+
+    using handlers_t = std::map<int, handler_slot>;
 
     epoll_event create_event(int fd, fd_state const &events);
+    void set_handler(int fd, handler_t &&handler);
 
     int queue_size;
     std::unique_ptr<epoll_event[]> events;
     handlers_t handlers;
+    handler_t const *running;       // Handler that is called now
     volatile bool started, stopped;
 };
 
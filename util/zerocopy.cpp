@@ -0,0 +1,82 @@
+#include "zerocopy.h"
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+zerocopy_tracker::zerocopy_tracker() : enabled(false), copied(false), next_id(0), pins{} { }
+
+bool zerocopy_tracker::enable(int fd) {
+    int one = 1;
+    enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0;
+    return enabled;
+}
+
+io_result zerocopy_tracker::send(int fd, char const *data, size_t length, pin_t pin) {
+    if (enabled && !copied && length >= MIN_LENGTH) {
+        io_result res = io_result::of(::send(fd, data, length, MSG_ZEROCOPY));
+        if (res.is_ok() && res.get() > 0) {
+            pins[next_id++] = std::move(pin);
+        }
+        // ENOBUFS means that too much is pinned now, it's sent with copying
+        if (res.is_ok() || res.get_errno() != ENOBUFS) {
+            return res;
+        }
+    }
+    return io_result::of(::send(fd, data, length, 0));
+}
+
+bool zerocopy_tracker::handle_completions(int fd) {
+    bool handled = false;
+    while (true) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err)) + CMSG_SPACE(sizeof(sockaddr_in6))];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            // Queue is empty
+            return handled;
+        }
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            sock_extended_err const *err = reinterpret_cast<sock_extended_err const *>(CMSG_DATA(cm));
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                continue;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied = true;
+            }
+            // Sends from ee_info to ee_data are completed, range may wrap
+            for (uint32_t id = err->ee_info;; id++) {
+                pins.erase(id);
+                if (id == err->ee_data) {
+                    break;
+                }
+            }
+            handled = true;
+        }
+    }
+}
+
+size_t zerocopy_tracker::get_pending() const {
+    return pins.size();
+}
+
+std::vector<zerocopy_tracker::pin_t> zerocopy_tracker::take_pins() {
+    std::vector<pin_t> res;
+    for (auto it = pins.begin(); it != pins.end(); it++) {
+        res.push_back(std::move(it->second));
+    }
+    pins.clear();
+    return res;
+}
@@ -0,0 +1,47 @@
+/*
+ * zerocopy.h
+ *
+ * Sending with MSG_ZEROCOPY
+ */
+
+#ifndef ZEROCOPY_H_
+#define ZEROCOPY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "wraps.h"
+
+// Zero-copy sending to one socket. Kernel reads sent data from user memory after send returns, so each
+// sent buffer is pinned until kernel reports its completion to error queue of the socket
+struct zerocopy_tracker {
+    using pin_t = std::shared_ptr<void const>;
+
+    // Shorter data is copied, pinning pages of it costs more than copying
+    static const size_t MIN_LENGTH = 16 * 1024;
+
+    zerocopy_tracker();
+
+    // Enable MSG_ZEROCOPY for socket. False if kernel doesn't support it, then data is always copied
+    bool enable(int fd);
+
+    // Send data that is kept alive by <pin>
+    io_result send(int fd, char const *data, size_t length, pin_t pin);
+
+    // Read completions from error queue of socket and unpin completed buffers. False if there were none
+    bool handle_completions(int fd);
+
+    // Buffers that kernel may still read
+    size_t get_pending() const;
+    std::vector<pin_t> take_pins();
+private:
+    bool enabled;
+    bool copied;                    // Kernel copied data anyway (E.G. to loopback), zero-copy only adds work
+    uint32_t next_id;               // Kernel numbers zero-copy sends that sent something
+    std::map<uint32_t, pin_t> pins;
+};
+
+#endif /* ZEROCOPY_H_ */